@@ -2,7 +2,9 @@
 
 #include "rtw.h"
 
-class aabb
+static_assert(sizeof(interval) == 2 * sizeof(float), "aabb::min_corner relies on packed intervals");
+
+class alignas(16) aabb
 {
     void pad_to_minimum()
     {
@@ -37,6 +39,18 @@ public:
         z = interval(box0.z, box1.z);
     }
 
+    float surface_area() const
+    {
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
+    int longest_axis() const
+    {
+        if (x.size() > y.size())
+            return x.size() > z.size() ? 0 : 2;
+        return y.size() > z.size() ? 1 : 2;
+    }
+
     const interval &axis_interval(int n) const
     {
         if (n == 1)
@@ -46,41 +60,59 @@ public:
         return x;
     }
 
+    vec3 min_corner() const
+    {
+#if RT_SIMD_SSE
+        // x, y and z are laid out as consecutive {min, max} pairs, so two unaligned loads and a
+        // shuffle gather the three minima (likewise the maxima). The padding lane is left undefined.
+        auto xy = _mm_loadu_ps(&x.min);
+        auto yz = _mm_loadu_ps(&y.min);
+        return vec3(_mm_shuffle_ps(xy, _mm_movehl_ps(yz, yz), _MM_SHUFFLE(3, 0, 2, 0)));
+#else
+        return vec3(x.min, y.min, z.min);
+#endif
+    }
+    vec3 max_corner() const
+    {
+#if RT_SIMD_SSE
+        auto xy = _mm_loadu_ps(&x.min);
+        auto yz = _mm_loadu_ps(&y.min);
+        return vec3(_mm_shuffle_ps(xy, _mm_movehl_ps(yz, yz), _MM_SHUFFLE(3, 1, 3, 1)));
+#else
+        return vec3(x.max, y.max, z.max);
+#endif
+    }
+
     bool hit(const ray &r, interval ray_t) const
     {
-        const vec3 ray_orig = r.origin();
-        const vec3 &ray_dir = r.direction();
-
-        for (int axis = 0; axis < 3; axis++)
-        {
-            const interval &ax = axis_interval(axis);
-            const float adinv = 1.0 / ray_dir[axis];
-
-            auto t0 = (ax.min - ray_orig[axis]) * adinv;
-            auto t1 = (ax.max - ray_orig[axis]) * adinv;
-
-            if (t0 < t1)
-            {
-                if (t0 > ray_t.min)
-                    ray_t.min = t0;
-                if (t1 < ray_t.max)
-                    ray_t.max = t1;
-            }
-            else
-            {
-                if (t1 > ray_t.min)
-                    ray_t.min = t1;
-                if (t0 < ray_t.max)
-                    ray_t.max = t0;
-            }
-
-            if (ray_t.max <= ray_t.min)
-                return false;
-        }
-        return true;
+        // All three slabs at once; the padding lane is ignored by min_component/max_component.
+        vec3 t0 = (min_corner() - r.origin()) * r.inv_direction();
+        vec3 t1 = (max_corner() - r.origin()) * r.inv_direction();
+
+        float t_enter = fmaxf(ray_t.min, max_component(vmin(t0, t1)));
+        float t_exit = fminf(ray_t.max, min_component(vmax(t0, t1)));
+        return t_enter < t_exit;
     }
+
+    static const aabb empty, universe;
 };
 
+const aabb aabb::empty = aabb(interval::empty, interval::empty, interval::empty);
+const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
+
+// Box swept linearly from a (time 0) to b (time 1), evaluated at the given time. Both ends are
+// already padded, so the result is built without padding it again.
+inline aabb lerp(const aabb &a, const aabb &b, float time)
+{
+    auto mix = [time](const interval &i0, const interval &i1)
+    { return interval(i0.min + time * (i1.min - i0.min), i0.max + time * (i1.max - i0.max)); };
+    aabb box;
+    box.x = mix(a.x, b.x);
+    box.y = mix(a.y, b.y);
+    box.z = mix(a.z, b.z);
+    return box;
+}
+
 aabb operator+(const aabb &bbox, const vec3 &offset)
 {
     return aabb(bbox.x + offset.x, bbox.y + offset.y, bbox.z + offset.z);
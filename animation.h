@@ -0,0 +1,189 @@
+#pragma once
+
+#include "rtw.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "camera.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+// Keyed value, linear between keys and held constant before the first and after the last key.
+template <typename T>
+class keyframes
+{
+    std::map<int, T> keys;
+
+public:
+    bool empty() const { return keys.empty(); }
+    void set(int frame, const T &value) { keys[frame] = value; }
+
+    T at(int frame) const
+    {
+        auto next = keys.lower_bound(frame);
+        if (next == keys.end())
+            return std::prev(next)->second;
+        if (next->first == frame || next == keys.begin())
+            return next->second;
+
+        auto prev = std::prev(next);
+        float t = float(frame - prev->first) / float(next->first - prev->first);
+        return prev->second + t * (next->second - prev->second);
+    }
+};
+
+class animation
+{
+    struct translate_track
+    {
+        shared_ptr<translate> object;
+        keyframes<vec3> offset;
+    };
+    struct rotate_track
+    {
+        shared_ptr<rotate_y> object;
+        keyframes<float> angle;
+    };
+
+    keyframes<vec3> lookfrom, lookat;
+    keyframes<float> vfov;
+    std::vector<translate_track> translates;
+    std::vector<rotate_track> rotations;
+
+    // Moves every keyed transform to its pose at the given frame. Returns true if anything moved.
+    bool apply_transforms(int frame)
+    {
+        bool moved = false;
+        for (auto &track : translates)
+        {
+            auto offset = track.offset.at(frame);
+            if ((offset - track.object->get_offset()).near_zero())
+                continue;
+            track.object->set_offset(offset);
+            moved = true;
+        }
+        for (auto &track : rotations)
+        {
+            auto angle = track.angle.at(frame);
+            if (angle == track.object->get_angle())
+                continue;
+            track.object->set_angle(angle);
+            moved = true;
+        }
+        return moved;
+    }
+
+    void apply_camera(camera &cam, int frame) const
+    {
+        if (!lookfrom.empty())
+            cam.lookfrom = lookfrom.at(frame);
+        if (!lookat.empty())
+            cam.lookat = lookat.at(frame);
+        if (!vfov.empty())
+            cam.vfov = vfov.at(frame);
+    }
+
+public:
+    int frame_count = 1;
+    // printf-style pattern taking the frame number, or "-" to stream raw RGB frames to stdout.
+    std::string output = "frame_%04d.ppm";
+    // Rebuild the BVH instead of refitting once its summed node area has grown by this factor.
+    float rebuild_threshold = 1.5f;
+
+    void camera_key(int frame, const vec3 &from, const vec3 &at, float fov)
+    {
+        lookfrom.set(frame, from);
+        lookat.set(frame, at);
+        vfov.set(frame, fov);
+    }
+
+    void translate_key(shared_ptr<translate> object, int frame, const vec3 &offset)
+    {
+        for (auto &track : translates)
+        {
+            if (track.object == object)
+            {
+                track.offset.set(frame, offset);
+                return;
+            }
+        }
+        translates.push_back({object, {}});
+        translates.back().offset.set(frame, offset);
+    }
+
+    void rotate_key(shared_ptr<rotate_y> object, int frame, float angle)
+    {
+        for (auto &track : rotations)
+        {
+            if (track.object == object)
+            {
+                track.angle.set(frame, angle);
+                return;
+            }
+        }
+        rotations.push_back({object, {}});
+        rotations.back().angle.set(frame, angle);
+    }
+
+    // Renders every frame against one resident scene. Between frames only the keyed transforms are
+    // updated and the BVH is refit bottom-up; it is rebuilt only when refitting has degraded it.
+    void render(camera cam, const hittable_list &objects)
+    {
+        using clock = std::chrono::steady_clock;
+        bool stream = output == "-";
+        cam.raw_output = stream;
+
+        hittable_list scene = objects;
+        apply_transforms(0);
+        scene.refit();
+        auto bvh = make_shared<bvh_node>(scene);
+
+        if (stream)
+            std::clog << "Streaming " << frame_count << " raw rgb24 frames of " << cam.image_width << 'x'
+                      << cam.get_image_height() << std::endl;
+
+        for (int frame = 0; frame < frame_count; frame++)
+        {
+            trace_span span("frame", "render", frame);
+            auto start = clock::now();
+            const char *update = frame == 0 ? "build" : "static";
+            if (frame > 0 && apply_transforms(frame))
+            {
+                bvh->refit();
+                update = "refit";
+                if (bvh->degradation() > rebuild_threshold)
+                {
+                    bvh = make_shared<bvh_node>(scene);
+                    update = "rebuild";
+                }
+            }
+            apply_camera(cam, frame);
+            auto setup = clock::now();
+
+            if (stream)
+            {
+                cam.render(*bvh, std::cout);
+                std::cout.flush();
+            }
+            else
+            {
+                char filename[512];
+                std::snprintf(filename, sizeof(filename), output.c_str(), frame);
+                std::ofstream out(filename);
+                cam.render(*bvh, out);
+            }
+            auto done = clock::now();
+
+            std::clog << "Frame " << frame + 1 << '/' << frame_count << " (" << update << "): setup "
+                      << std::chrono::duration<double, std::milli>(setup - start).count() << " ms, render "
+                      << std::chrono::duration<double, std::milli>(done - setup).count() << " ms" << std::endl;
+        }
+    }
+};
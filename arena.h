@@ -0,0 +1,85 @@
+#pragma once
+
+#include "rtw.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Monotonic bump allocator for scene objects. Primitives, materials and textures created through
+// make() sit next to each other in large blocks instead of at scattered heap addresses, and are
+// all destroyed and freed together when the arena goes away.
+//
+// make() hands out non-owning shared_ptr handles (aliasing an empty owner): they have no control
+// block and copying them does no reference counting, so they drop into every existing
+// shared_ptr-taking constructor. The arena must outlive every handle it has given out.
+//
+// Types with a constructor taking the arena first get it from make(), so objects they create
+// themselves (a lambertian's solid_color, say) land in the arena too. BVH nodes do not: they are
+// built concurrently on the thread pool, and the arena is not thread-safe.
+class scene_arena
+{
+    struct destructor
+    {
+        void (*destroy)(void *);
+        void *object;
+    };
+
+    static constexpr size_t block_size = 64 * 1024;
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::vector<destructor> destructors;
+    std::byte *cursor = nullptr;
+    size_t remaining = 0;
+
+    void *allocate(size_t size, size_t alignment)
+    {
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+        if (cursor == nullptr || padding + size > remaining)
+        {
+            // Oversized objects get a block of their own; alignof(max_align_t) or better comes from new[].
+            size_t capacity = std::max(block_size, size + alignment);
+            blocks.push_back(std::make_unique<std::byte[]>(capacity));
+            cursor = blocks.back().get();
+            remaining = capacity;
+            padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+        }
+
+        void *p = cursor + padding;
+        cursor += padding + size;
+        remaining -= padding + size;
+        return p;
+    }
+
+public:
+    scene_arena() = default;
+    scene_arena(const scene_arena &) = delete;
+    scene_arena &operator=(const scene_arena &) = delete;
+
+    ~scene_arena()
+    {
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+            it->destroy(it->object);
+    }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args &&...args)
+    {
+        void *memory = allocate(sizeof(T), alignof(T));
+        T *object;
+        if constexpr (std::is_constructible_v<T, scene_arena &, Args &&...>)
+            object = new (memory) T(*this, std::forward<Args>(args)...);
+        else
+            object = new (memory) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            destructors.push_back({[](void *p)
+                                   { static_cast<T *>(p)->~T(); },
+                                   object});
+        return shared_ptr<T>(shared_ptr<T>(), object);
+    }
+};
@@ -0,0 +1,486 @@
+#pragma once
+
+#include "rtw.h"
+#include "environment.h"
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Image that path contributions can be added to at any pixel from any thread, for light paths
+// connected straight to the camera.
+class splat_buffer
+{
+    int width, height;
+    std::unique_ptr<std::atomic<float>[]> values;
+
+    static void add(std::atomic<float> &target, float value)
+    {
+        float current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+public:
+    splat_buffer(int width, int height)
+        : width(width), height(height), values(new std::atomic<float>[size_t(width) * height * 3]()) {}
+
+    void add(int i, int j, const color &c)
+    {
+        std::atomic<float> *p = &values[(size_t(j) * width + i) * 3];
+        add(p[0], c.x);
+        add(p[1], c.y);
+        add(p[2], c.z);
+    }
+
+    color get(int i, int j) const
+    {
+        const std::atomic<float> *p = &values[(size_t(j) * width + i) * 3];
+        return color(p[0].load(), p[1].load(), p[2].load());
+    }
+};
+
+// Bidirectional path tracer. Each sample traces a subpath from the camera and one from a light
+// (chosen by power, from the emitters world.collect_lights() reports), then joins every prefix of
+// one to every prefix of the other with a shadow ray. The many ways of building the same path are
+// combined with the balance heuristic, so each path is weighted towards the strategies that find
+// it easily: camera paths for lights seen directly, light paths for small lights that only reach
+// the visible scene after a bounce, and both for lit smoke. Light vertices joined to the camera
+// land on arbitrary pixels and go to the splat buffer.
+//
+// Lambertian surfaces and isotropic media can be connected through; metal and glass are only
+// sampled. The camera must be a pinhole.
+class bdpt_integrator
+{
+public:
+    // Pinhole camera: rays leave center through the image plane given by the first pixel's center
+    // and the per-pixel steps, facing forward.
+    struct pinhole
+    {
+        vec3 center, forward, pixel00, delta_u, delta_v;
+        int width, height;
+    };
+
+private:
+    enum vertex_type
+    {
+        camera_vertex,
+        light_vertex,
+        surface_vertex,
+        medium_vertex
+    };
+
+    struct vertex
+    {
+        vertex_type type;
+        hitrecord rec;
+        color beta;
+        color emitted;
+        int light = -1; // index into lights when the vertex lies on a sampled emitter
+        bool delta = false;
+        float pdf_fwd = 0, pdf_rev = 0;
+
+        bool on_surface() const { return type == surface_vertex || type == light_vertex; }
+    };
+
+public:
+    struct paths
+    {
+        std::vector<vertex> camera, light;
+    };
+
+private:
+    const hittable &world;
+    pinhole view;
+    float plane_distance, plane_area; // image plane area scaled to distance 1
+
+    std::vector<const hittable *> lights;
+    std::vector<float> light_cdf, light_pick, light_area;
+    std::vector<std::pair<const hittable *, int>> light_index; // sorted for lookup by object
+
+    int find_light(const hittable *object) const
+    {
+        auto it = std::lower_bound(light_index.begin(), light_index.end(), std::make_pair(object, -1));
+        return it != light_index.end() && it->first == object ? it->second : -1;
+    }
+
+    int pick_light() const
+    {
+        float u = random_float() * light_cdf.back();
+        int index = int(std::upper_bound(light_cdf.begin(), light_cdf.end(), u) - light_cdf.begin()) - 1;
+        return std::clamp(index, 0, int(lights.size()) - 1);
+    }
+
+    float camera_pdf(const vec3 &direction) const
+    {
+        float cosine = dot(unit(direction), view.forward);
+        return cosine > 0 ? 1 / (plane_area * cosine * cosine * cosine) : 0;
+    }
+
+    float camera_importance(const vec3 &direction) const
+    {
+        float cosine = dot(unit(direction), view.forward);
+        return cosine > 0 ? 1 / (plane_area * cosine * cosine * cosine * cosine) : 0;
+    }
+
+    // Pixel a direction from the camera passes through, if any.
+    bool raster(const vec3 &direction, int &i, int &j) const
+    {
+        float cosine = dot(unit(direction), view.forward);
+        if (cosine <= 0)
+            return false;
+        vec3 rel = view.center + (plane_distance / cosine) * unit(direction) - view.pixel00;
+        float fi = dot(rel, view.delta_u) / view.delta_u.length_squared() + 0.5f;
+        float fj = dot(rel, view.delta_v) / view.delta_v.length_squared() + 0.5f;
+        if (!(fi >= 0 && fj >= 0 && fi < view.width && fj < view.height))
+            return false;
+        i = std::min(int(fi), view.width - 1);
+        j = std::min(int(fj), view.height - 1);
+        return true;
+    }
+
+    // Solid-angle density at from turned into area density at to.
+    static float to_area(float pdf, const vertex &from, const vertex &to)
+    {
+        vec3 d = to.rec.position - from.rec.position;
+        float distance_squared = d.length_squared();
+        if (distance_squared == 0)
+            return 0;
+        if (to.on_surface())
+            pdf *= fabs(dot(to.rec.normal, d)) / sqrt(distance_squared);
+        return pdf / distance_squared;
+    }
+
+    static float geometry(const vertex &a, const vertex &b)
+    {
+        vec3 d = b.rec.position - a.rec.position;
+        float distance_squared = d.length_squared();
+        vec3 w = d / sqrt(distance_squared);
+        float g = 1 / distance_squared;
+        if (a.on_surface())
+            g *= fabs(dot(a.rec.normal, w));
+        if (b.on_surface())
+            g *= fabs(dot(b.rec.normal, w));
+        return g;
+    }
+
+    bool visible(const vertex &a, const vertex &b, float time, uint64_t &rays) const
+    {
+        rays++;
+        ray r(a.rec.position, b.rec.position - a.rec.position, time);
+        return !world.occluded(r, interval(1e-4f, 1 - 1e-4f));
+    }
+
+    static bool connectible(const vertex &v)
+    {
+        return v.type == light_vertex || v.type == camera_vertex || !v.rec.mat->is_specular();
+    }
+
+    // BSDF at v for light arriving from prev and leaving towards next.
+    static color f(const vertex &v, const vertex &prev, const vertex &next)
+    {
+        return v.rec.mat->eval(v.rec, unit(prev.rec.position - v.rec.position), unit(next.rec.position - v.rec.position));
+    }
+
+    // Diffuse emitters send light from both faces: cosine-weighted on a randomly chosen side.
+    float pdf_light(const vertex &v, const vertex &next) const
+    {
+        vec3 w = unit(next.rec.position - v.rec.position);
+        return to_area(fabs(dot(v.rec.normal, w)) / (2 * PI), v, next);
+    }
+
+    float pdf_light_origin(const vertex &v) const
+    {
+        return v.light >= 0 ? light_pick[v.light] / light_area[v.light] : 0;
+    }
+
+    // Area density of sampling next from v, when v was itself reached from prev.
+    float pdf(const vertex &v, const vertex *prev, const vertex &next) const
+    {
+        if (v.type == light_vertex)
+            return pdf_light(v, next);
+        vec3 wn = next.rec.position - v.rec.position;
+        if (v.type == camera_vertex)
+            return to_area(camera_pdf(wn), v, next);
+        return to_area(v.rec.mat->pdf(v.rec, unit(prev->rec.position - v.rec.position), unit(wn)), v, next);
+    }
+
+    // Extends path from its last vertex along r. Returns true if the walk ended by leaving the
+    // scene, with r and beta the escaping ray and its throughput.
+    bool random_walk(ray &r, color &beta, float pdf_dir, size_t max_vertices, std::vector<vertex> &path,
+                     uint64_t &rays) const
+    {
+        while (path.size() < max_vertices)
+        {
+            rays++;
+            vertex v;
+            if (!world.hit(r, interval(0.001, infinity), v.rec))
+                return true;
+
+            v.type = v.rec.mat->is_volume() ? medium_vertex : surface_vertex;
+            v.beta = beta;
+            v.pdf_fwd = to_area(pdf_dir, path.back(), v);
+            v.emitted = v.rec.mat->emitted(v.rec.u, v.rec.v, v.rec.position);
+            if (v.emitted.x > 0 || v.emitted.y > 0 || v.emitted.z > 0)
+                v.light = find_light(v.rec.object);
+            path.push_back(v);
+
+            ray scattered;
+            color attenuation;
+            if (!v.rec.mat->scatter(r, v.rec, attenuation, scattered))
+                break;
+
+            vertex &current = path.back();
+            float pdf_back = 0;
+            if (current.rec.mat->is_specular())
+            {
+                current.delta = true;
+                pdf_dir = 0;
+            }
+            else
+            {
+                vec3 wi = unit(-r.direction()), wo = unit(scattered.direction());
+                pdf_dir = current.rec.mat->pdf(current.rec, wi, wo);
+                pdf_back = current.rec.mat->pdf(current.rec, wo, wi);
+            }
+            beta = beta * attenuation;
+            path[path.size() - 2].pdf_rev = to_area(pdf_back, current, path[path.size() - 2]);
+            r = scattered;
+        }
+        return false;
+    }
+
+    // Balance heuristic weight of the strategy joining s light and t camera vertices, relative to
+    // every other strategy that could have produced the same path. sampled replaces the end vertex
+    // of the shorter subpath when s or t is 1.
+    float mis_weight(paths &p, const vertex &sampled, int s, int t) const
+    {
+        if (s + t == 2)
+            return 1;
+
+        vertex *qs = s > 0 ? &p.light[s - 1] : nullptr;
+        vertex *pt = t > 0 ? &p.camera[t - 1] : nullptr;
+        vertex *qs_minus = s > 1 ? &p.light[s - 2] : nullptr;
+        vertex *pt_minus = t > 1 ? &p.camera[t - 2] : nullptr;
+
+        // The updates below only hold for this strategy; put everything back afterwards.
+        vertex saved[4];
+        vertex *touched[4] = {qs, pt, qs_minus, pt_minus};
+        for (int k = 0; k < 4; k++)
+            if (touched[k])
+                saved[k] = *touched[k];
+
+        if (s == 1)
+            *qs = sampled;
+        else if (t == 1)
+            *pt = sampled;
+        if (pt)
+            pt->delta = false;
+        if (qs)
+            qs->delta = false;
+        pt->pdf_rev = s > 0 ? pdf(*qs, qs_minus, *pt) : pdf_light_origin(*pt);
+        if (pt_minus)
+            pt_minus->pdf_rev = s > 0 ? pdf(*pt, qs, *pt_minus) : pdf_light(*pt, *pt_minus);
+        if (qs)
+            qs->pdf_rev = pdf(*pt, pt_minus, *qs);
+        if (qs_minus)
+            qs_minus->pdf_rev = pdf(*qs, pt, *qs_minus);
+
+        auto remap0 = [](float f)
+        { return f != 0 ? f : 1; };
+        float sum = 0, ri = 1;
+        for (int i = t - 1; i > 0; i--)
+        {
+            ri *= remap0(p.camera[i].pdf_rev) / remap0(p.camera[i].pdf_fwd);
+            if (!p.camera[i].delta && !p.camera[i - 1].delta)
+                sum += ri;
+        }
+        ri = 1;
+        for (int i = s - 1; i >= 0; i--)
+        {
+            ri *= remap0(p.light[i].pdf_rev) / remap0(p.light[i].pdf_fwd);
+            if (!p.light[i].delta && !(i > 0 && p.light[i - 1].delta))
+                sum += ri;
+        }
+
+        for (int k = 0; k < 4; k++)
+            if (touched[k])
+                *touched[k] = saved[k];
+        return 1 / (1 + sum);
+    }
+
+    // Contribution of strategy (s, t). For t == 1 it belongs to pixel (i, j) instead of the
+    // current one and splat is set.
+    color connect(paths &p, int s, int t, float time, uint64_t &rays, bool &splat, int &i, int &j) const
+    {
+        vertex sampled;
+        color L(0, 0, 0);
+        splat = false;
+
+        if (s == 0)
+        {
+            const vertex &pt = p.camera[t - 1];
+            if (pt.type != surface_vertex || !(pt.emitted.x > 0 || pt.emitted.y > 0 || pt.emitted.z > 0))
+                return L;
+            L = pt.beta * pt.emitted;
+            // Emitters light sampling does not know about are only ever found this way.
+            if (pt.light < 0)
+                return L;
+        }
+        else if (t == 1)
+        {
+            const vertex &qs = p.light[s - 1];
+            if (!connectible(qs) || qs.type == light_vertex)
+                return L;
+            vec3 to_camera = view.center - qs.rec.position;
+            if (!raster(-to_camera, i, j))
+                return L;
+
+            sampled.type = camera_vertex;
+            sampled.rec.position = view.center;
+            float distance_squared = to_camera.length_squared();
+            float cos_camera = dot(unit(-to_camera), view.forward);
+            sampled.beta = color(1, 1, 1) * (camera_importance(-to_camera) * cos_camera / distance_squared);
+
+            L = qs.beta * f(qs, p.light[s - 2], sampled) * sampled.beta;
+            if (qs.on_surface())
+                L = L * fabs(dot(qs.rec.normal, unit(to_camera)));
+            if (L.x <= 0 && L.y <= 0 && L.z <= 0)
+                return L;
+            if (!visible(qs, sampled, time, rays))
+                return color(0, 0, 0);
+            splat = true;
+        }
+        else if (s == 1)
+        {
+            const vertex &pt = p.camera[t - 1];
+            if (!connectible(pt) || lights.empty())
+                return L;
+            int index = pick_light();
+            sampled.type = light_vertex;
+            float area = lights[index]->sample_surface(sampled.rec);
+            if (area <= 0)
+                return L;
+            sampled.light = index;
+            sampled.emitted = sampled.rec.mat->emitted(sampled.rec.u, sampled.rec.v, sampled.rec.position);
+            sampled.pdf_fwd = light_pick[index] / area;
+            sampled.beta = sampled.emitted / sampled.pdf_fwd;
+
+            L = pt.beta * f(pt, p.camera[t - 2], sampled) * sampled.beta * geometry(pt, sampled);
+            if (L.x <= 0 && L.y <= 0 && L.z <= 0)
+                return L;
+            if (!visible(pt, sampled, time, rays))
+                return color(0, 0, 0);
+        }
+        else
+        {
+            const vertex &qs = p.light[s - 1], &pt = p.camera[t - 1];
+            if (!connectible(qs) || !connectible(pt))
+                return L;
+            L = qs.beta * f(qs, p.light[s - 2], pt) * f(pt, p.camera[t - 2], qs) * pt.beta * geometry(qs, pt);
+            if (L.x <= 0 && L.y <= 0 && L.z <= 0)
+                return L;
+            if (!visible(qs, pt, time, rays))
+                return color(0, 0, 0);
+        }
+
+        return L * mis_weight(p, sampled, s, t);
+    }
+
+public:
+    int max_depth; // bounces
+    color background;
+    const environment_light *environment = nullptr;
+    splat_buffer splats;
+
+    bdpt_integrator(const hittable &world, const pinhole &view, int max_depth)
+        : world(world), view(view), max_depth(max_depth), splats(view.width, view.height)
+    {
+        this->view.forward = unit(view.forward);
+        plane_distance = dot(view.pixel00 - view.center, this->view.forward);
+        float area = view.width * view.delta_u.length() * view.height * view.delta_v.length();
+        plane_area = area / (plane_distance * plane_distance);
+
+        std::vector<const hittable *> found;
+        world.collect_lights(found);
+        light_cdf.push_back(0);
+        for (const auto *light : found)
+        {
+            hitrecord rec;
+            float power = light->emitter().power;
+            float area = light->sample_surface(rec);
+            if (power <= 0 || area <= 0)
+                continue;
+            light_index.push_back({light, int(lights.size())});
+            lights.push_back(light);
+            light_area.push_back(area);
+            light_cdf.push_back(light_cdf.back() + power);
+        }
+        for (size_t k = 0; k < lights.size(); k++)
+            light_pick.push_back((light_cdf[k + 1] - light_cdf[k]) / light_cdf.back());
+        std::sort(light_index.begin(), light_index.end());
+    }
+
+    // Radiance estimate for one camera ray; light paths joined to the camera go to splats.
+    color sample(const ray &camera_ray, paths &p, uint64_t &rays)
+    {
+        float time = camera_ray.time();
+        p.camera.clear();
+        p.light.clear();
+
+        vertex camera;
+        camera.type = camera_vertex;
+        camera.rec.position = view.center;
+        camera.beta = color(1, 1, 1);
+        p.camera.push_back(camera);
+
+        // Background and environment are only reached by camera paths.
+        color L(0, 0, 0);
+        ray r = camera_ray;
+        color beta = camera.beta;
+        if (random_walk(r, beta, camera_pdf(r.direction()), max_depth + 2, p.camera, rays))
+            L = beta * (environment ? environment->value(r.direction()) : background);
+
+        if (!lights.empty())
+        {
+            int index = pick_light();
+            vertex light;
+            light.type = light_vertex;
+            float area = lights[index]->sample_surface(light.rec);
+            light.light = index;
+            light.emitted = light.rec.mat->emitted(light.rec.u, light.rec.v, light.rec.position);
+            light.pdf_fwd = light_pick[index] / area;
+            light.beta = light.emitted / light.pdf_fwd;
+            if (random_float() < 0.5f)
+                light.rec.normal = -light.rec.normal;
+            p.light.push_back(light);
+
+            vec3 direction = onb(light.rec.normal).transform(random_cosine_direction());
+            float pdf_dir = dot(unit(direction), light.rec.normal) / (2 * PI);
+            ray light_ray(light.rec.position, direction, time);
+            color light_beta = light.emitted * (fabs(dot(unit(direction), light.rec.normal)) / (light.pdf_fwd * pdf_dir));
+            random_walk(light_ray, light_beta, pdf_dir, max_depth + 1, p.light, rays);
+        }
+
+        for (int t = 1; t <= int(p.camera.size()); t++)
+            for (int s = 0; s <= int(p.light.size()); s++)
+            {
+                int depth = s + t - 2;
+                if ((s == 1 && t == 1) || depth < 0 || depth > max_depth)
+                    continue;
+                bool splat;
+                int i, j;
+                color c = connect(p, s, t, time, rays, splat, i, j);
+                if (splat)
+                    splats.add(i, j, c);
+                else
+                    L += c;
+            }
+        return L;
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "rtw.h"
+#include "hittable.h"
+
+// Closed box intersected with a single slab test. The box may be oriented: it is defined by two
+// opposite corners, then optionally rotated about an axis through the origin and moved by an
+// offset, which matches translate(rotate(box)) without the per-ray wrapper calls. Only the face
+// that is actually hit gets its normal and UV computed.
+class box : public hittable
+{
+    vec3 center;
+    vec3 half;
+    // Local box axes in world space; rows of the world-to-local rotation.
+    vec3 axis[3];
+    shared_ptr<material> mat;
+    aabb bbox;
+
+    vec3 to_local(const vec3 &v) const { return vec3(dot(axis[0], v), dot(axis[1], v), dot(axis[2], v)); }
+    vec3 to_world(const vec3 &v) const { return v.x * axis[0] + v.y * axis[1] + v.z * axis[2]; }
+
+    // Entry and exit distances along the local ray, plus the slab axis each one happened on.
+    bool slabs(const vec3 &origin, const vec3 &inv_dir, float &t_enter, int &enter_axis, float &t_exit, int &exit_axis) const
+    {
+        t_enter = -infinity;
+        t_exit = infinity;
+        enter_axis = exit_axis = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            float t0 = (-half[a] - origin[a]) * inv_dir[a];
+            float t1 = (half[a] - origin[a]) * inv_dir[a];
+            if (t0 > t1)
+                std::swap(t0, t1);
+            if (t0 > t_enter)
+            {
+                t_enter = t0;
+                enter_axis = a;
+            }
+            if (t1 < t_exit)
+            {
+                t_exit = t1;
+                exit_axis = a;
+            }
+        }
+        return t_enter <= t_exit;
+    }
+
+public:
+    box(const vec3 &a, const vec3 &b, shared_ptr<material> mat)
+        : box(a, b, mat, vec3(0, 1, 0), 0, vec3(0, 0, 0)) {}
+
+    // Rotated by angle degrees about rotation_axis (through the origin), then moved by offset.
+    box(const vec3 &a, const vec3 &b, shared_ptr<material> mat, const vec3 &rotation_axis, float angle, const vec3 &offset)
+        : mat(mat)
+    {
+        auto lo = vmin(a, b);
+        auto hi = vmax(a, b);
+        half = 0.5f * (hi - lo);
+
+        // Rodrigues' rotation of the world axes gives the box axes in world space.
+        auto k = unit(rotation_axis);
+        float radians = to_radians(angle);
+        float c = cos(radians), s = sin(radians);
+        auto rotate = [&](const vec3 &v)
+        { return c * v + s * cross(k, v) + (1 - c) * dot(k, v) * k; };
+        axis[0] = rotate(vec3(1, 0, 0));
+        axis[1] = rotate(vec3(0, 1, 0));
+        axis[2] = rotate(vec3(0, 0, 1));
+        center = rotate(0.5f * (lo + hi)) + offset;
+
+        vec3 extent(0, 0, 0);
+        for (int i = 0; i < 3; i++)
+            extent += half[i] * vec3(fabs(axis[i].x), fabs(axis[i].y), fabs(axis[i].z));
+        bbox = aabb(center - extent, center + extent);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    unsigned features() const override { return mat->is_emissive() ? unsigned(feature_emission) : 0u; }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+    {
+        vec3 origin = to_local(r.origin() - center);
+        vec3 direction = to_local(r.direction());
+
+        float t_enter, t_exit;
+        int enter_axis, exit_axis;
+        if (!slabs(origin, rcp(direction), t_enter, enter_axis, t_exit, exit_axis))
+            return false;
+
+        // From outside the first face is the entry; from inside (e.g. glass or smoke) it is the exit.
+        float t;
+        int face;
+        float side;
+        if (ray_t.contains(t_enter))
+        {
+            t = t_enter;
+            face = enter_axis;
+            side = direction[face] > 0 ? -1 : 1;
+        }
+        else if (ray_t.contains(t_exit))
+        {
+            t = t_exit;
+            face = exit_axis;
+            side = direction[face] > 0 ? 1 : -1;
+        }
+        else
+            return false;
+
+        rec.t = t;
+        rec.position = r.at(t);
+        rec.mat = mat.get();
+        rec.object = this;
+        rec.setNormal(r, side * axis[face]);
+
+        // UV spans the face from its local minimum corner, using the two axes other than the normal.
+        vec3 local = origin + t * direction;
+        int u_axis = face == 0 ? 2 : 0;
+        int v_axis = face == 1 ? 2 : 1;
+        rec.u = (local[u_axis] + half[u_axis]) / (2 * half[u_axis]);
+        rec.v = (local[v_axis] + half[v_axis]) / (2 * half[v_axis]);
+        return true;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        float t_enter, t_exit;
+        int enter_axis, exit_axis;
+        if (!slabs(to_local(r.origin() - center), rcp(to_local(r.direction())), t_enter, enter_axis, t_exit, exit_axis))
+            return false;
+        return ray_t.contains(t_enter) || ray_t.contains(t_exit);
+    }
+
+    bool inside_span(const ray &r, interval &inside) const override
+    {
+        float t_enter, t_exit;
+        int enter_axis, exit_axis;
+        if (!slabs(to_local(r.origin() - center), rcp(to_local(r.direction())), t_enter, enter_axis, t_exit, exit_axis))
+            return false;
+        inside = interval(t_enter, t_exit);
+        return true;
+    }
+};
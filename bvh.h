@@ -0,0 +1,316 @@
+#pragma once
+
+#include "rtw.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+
+// How bvh_node picks its splits. fast cuts each range at the object median along the widest axis
+// of the centroids. quality places the cut at the cheapest of 16 binned planes per axis under the
+// surface area heuristic: a little slower to build, and faster to trace when objects are unevenly
+// sized or spread.
+enum class bvh_build
+{
+    fast,
+    quality
+};
+
+// Built top-down on the global thread pool: bounds, centroids and SAH bins of large ranges are
+// gathered in parallel chunks, and the two halves of every large range are built concurrently.
+class bvh_node : public hittable
+{
+    friend class compact_bvh; // flattens the topology built here
+
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    aabb bbox;
+
+    // Bounds of the subtree at the start (time 0) and end (time 1) of the shutter. For moving
+    // geometry the box at a given ray time is interpolated between them, which is much tighter
+    // than the swept union stored in bbox.
+    aabb bbox0, bbox1;
+    bool is_moving;
+
+    // Children are bvh_nodes themselves unless this node was built over two or fewer objects.
+    bool interior = false;
+    // Summed surface area of all boxes in the subtree, now and when it was built. Refitting after
+    // large transforms inflates the former; the ratio tells the caller when to rebuild instead.
+    float area_sum = 0;
+    float built_area_sum = 0;
+
+    void update_bounds()
+    {
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+        bbox0 = aabb(left->bounding_box_at(0), right->bounding_box_at(0));
+        bbox1 = aabb(left->bounding_box_at(1), right->bounding_box_at(1));
+        is_moving = !(bbox0.x.min == bbox1.x.min && bbox0.x.max == bbox1.x.max &&
+                      bbox0.y.min == bbox1.y.min && bbox0.y.max == bbox1.y.max &&
+                      bbox0.z.min == bbox1.z.min && bbox0.z.max == bbox1.z.max);
+
+        area_sum = bbox.surface_area();
+        if (interior)
+            area_sum += static_cast<const bvh_node &>(*left).area_sum + static_cast<const bvh_node &>(*right).area_sum;
+    }
+
+    // An object to be placed, with the bounds and centroid the build needs computed once up front.
+    struct build_ref
+    {
+        shared_ptr<hittable> object;
+        aabb bounds;
+        vec3 centroid;
+    };
+
+    struct sah_bin
+    {
+        aabb bounds = aabb::empty;
+        size_t count = 0;
+    };
+
+    static constexpr int sah_bins = 16;
+    // Ranges at least this large build their two halves on separate threads.
+    static constexpr size_t parallel_threshold = 4096;
+    static constexpr size_t chunk_size = 16384;
+
+    static size_t chunk_count(size_t count) { return (count + chunk_size - 1) / chunk_size; }
+
+    // Runs body(begin, end, chunk) over chunk_size pieces of [0, count) on the thread pool.
+    template <typename Body>
+    static void for_chunks(size_t count, Body &&body)
+    {
+        size_t chunks = chunk_count(count);
+        if (chunks == 1)
+            body(size_t(0), count, size_t(0));
+        else
+            thread_pool::global().parallel_for(chunks, [&](size_t c)
+                                               { body(c * chunk_size, std::min(count, (c + 1) * chunk_size), c); });
+    }
+
+    static vec3 center(const aabb &box)
+    {
+        return 0.5f * vec3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max);
+    }
+
+    // Lets build() use make_shared (one allocation per node) on a constructor nobody else can call.
+    struct build_key
+    {
+    };
+
+    void build(build_ref *refs, size_t count, bvh_build mode)
+    {
+        if (count == 1)
+        {
+            left = right = refs[0].object;
+        }
+        else if (count == 2)
+        {
+            left = refs[0].object;
+            right = refs[1].object;
+        }
+        else
+        {
+            size_t mid = split(refs, count, mode);
+            auto child = [&](size_t side)
+            {
+                if (side == 0)
+                    left = make_shared<bvh_node>(build_key(), refs, mid, mode);
+                else
+                    right = make_shared<bvh_node>(build_key(), refs + mid, count - mid, mode);
+            };
+            if (count >= parallel_threshold)
+                thread_pool::global().parallel_for(2, child);
+            else
+            {
+                child(0);
+                child(1);
+            }
+            interior = true;
+        }
+
+        update_bounds();
+        built_area_sum = area_sum;
+    }
+
+    // Reorders refs into two non-empty groups and returns the size of the first.
+    static size_t split(build_ref *refs, size_t count, bvh_build mode)
+    {
+        std::vector<aabb> partial(chunk_count(count), aabb::empty);
+        for_chunks(count, [&](size_t begin, size_t end, size_t c)
+                   {
+            aabb box = aabb::empty;
+            for (size_t i = begin; i < end; i++)
+                box = aabb(box, aabb(refs[i].centroid, refs[i].centroid));
+            partial[c] = box; });
+        aabb centroids = aabb::empty;
+        for (const auto &box : partial)
+            centroids = aabb(centroids, box);
+
+        int axis = centroids.longest_axis();
+        size_t mid = count / 2;
+        if (mode == bvh_build::quality)
+        {
+            size_t sah_mid;
+            if (sah_split(refs, count, centroids, sah_mid))
+                return sah_mid;
+        }
+        std::nth_element(refs, refs + mid, refs + count, [axis](const build_ref &a, const build_ref &b)
+                         { return a.centroid[axis] < b.centroid[axis]; });
+        return mid;
+    }
+
+    // Bins the centroids on every axis and partitions at the plane with the lowest surface area
+    // heuristic cost. Fails when the centroids cannot be told apart.
+    static bool sah_split(build_ref *refs, size_t count, const aabb &centroids, size_t &mid)
+    {
+        float lo[3], scale[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &range = centroids.axis_interval(axis);
+            lo[axis] = range.min;
+            scale[axis] = range.size() > 0 ? sah_bins / range.size() : 0;
+        }
+        auto bin_of = [&](const build_ref &ref, int axis)
+        { return std::clamp(int((ref.centroid[axis] - lo[axis]) * scale[axis]), 0, sah_bins - 1); };
+
+        std::vector<std::array<sah_bin, 3 * sah_bins>> partial(chunk_count(count));
+        for_chunks(count, [&](size_t begin, size_t end, size_t c)
+                   {
+            auto &bins = partial[c];
+            for (size_t i = begin; i < end; i++)
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    sah_bin &bin = bins[axis * sah_bins + bin_of(refs[i], axis)];
+                    bin.bounds = aabb(bin.bounds, refs[i].bounds);
+                    bin.count++;
+                }
+        });
+        std::array<sah_bin, 3 * sah_bins> bins;
+        for (const auto &p : partial)
+            for (int b = 0; b < 3 * sah_bins; b++)
+            {
+                bins[b].bounds = aabb(bins[b].bounds, p[b].bounds);
+                bins[b].count += p[b].count;
+            }
+
+        // Cost of a split relative to tracing every object: (area * count) summed over both sides.
+        float best_cost = infinity;
+        int best_axis = -1, best_plane = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (centroids.axis_interval(axis).size() <= 0.0001f)
+                continue;
+            const sah_bin *axis_bins = &bins[axis * sah_bins];
+            float right_cost[sah_bins];
+            aabb box = aabb::empty;
+            size_t n = 0;
+            for (int b = sah_bins - 1; b > 0; b--)
+            {
+                box = aabb(box, axis_bins[b].bounds);
+                n += axis_bins[b].count;
+                right_cost[b] = n ? box.surface_area() * n : 0;
+            }
+            box = aabb::empty;
+            n = 0;
+            for (int plane = 1; plane < sah_bins; plane++)
+            {
+                box = aabb(box, axis_bins[plane - 1].bounds);
+                n += axis_bins[plane - 1].count;
+                if (n == 0 || n == count)
+                    continue;
+                float cost = box.surface_area() * n + right_cost[plane];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_plane = plane;
+                }
+            }
+        }
+        if (best_axis < 0)
+            return false;
+
+        mid = std::partition(refs, refs + count, [&](const build_ref &ref)
+                             { return bin_of(ref, best_axis) < best_plane; }) -
+              refs;
+        return mid > 0 && mid < count;
+    }
+
+public:
+    bvh_node(build_key, build_ref *refs, size_t count, bvh_build mode) { build(refs, count, mode); }
+
+    bvh_node(hittable_list list, bvh_build mode = bvh_build::quality)
+        : bvh_node(list.objects, 0, list.objects.size(), mode) {}
+
+    bvh_node(const std::vector<shared_ptr<hittable>> &objects, size_t start, size_t end, bvh_build mode = bvh_build::quality)
+    {
+        trace_span span("bvh build", "build", int64_t(end - start));
+        std::vector<build_ref> refs(end - start);
+        for_chunks(refs.size(), [&](size_t begin, size_t stop, size_t)
+                   {
+            for (size_t i = begin; i < stop; i++)
+            {
+                const auto &object = objects[start + i];
+                refs[i] = {object, object->bounding_box(), center(object->bounding_box_at(0.5f))};
+            } });
+        build(refs.data(), refs.size(), mode);
+    }
+
+    // Refit keeps the topology and only recomputes bounds, so it is only as good as the original
+    // partition. degradation() reports how much the summed node area has grown since the build.
+    void refit() override
+    {
+        left->refit();
+        if (right != left)
+            right->refit();
+        update_bounds();
+    }
+
+    float degradation() const { return area_sum / built_area_sum; }
+
+    void collect_lights(std::vector<const hittable *> &lights) const override
+    {
+        left->collect_lights(lights);
+        if (right != left)
+            right->collect_lights(lights);
+    }
+    unsigned features() const override { return left->features() | right->features(); }
+    bool save(snapshot_writer &out) const override
+    {
+        if (right == left)
+            return left->save(out);
+        size_t node = is_moving ? out.interior_moving(bbox0, bbox1) : out.interior(bbox);
+        if (!left->save(out))
+            return false;
+        out.second_child(node);
+        return right->save(out);
+    }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+    {
+        if (is_moving ? !lerp(bbox0, bbox1, r.time()).hit(r, ray_t) : !bbox.hit(r, ray_t))
+            return false;
+
+        bool hit_left = left->hit(r, ray_t, rec);
+        bool hit_right = right != left && right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+        return hit_left || hit_right;
+    }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        if (is_moving ? !lerp(bbox0, bbox1, r.time()).hit(r, ray_t) : !bbox.hit(r, ray_t))
+            return false;
+        return left->occluded(r, ray_t) || (right != left && right->occluded(r, ray_t));
+    }
+    bool ready(const ray &r, interval ray_t) const override
+    {
+        if (is_moving ? !lerp(bbox0, bbox1, r.time()).hit(r, ray_t) : !bbox.hit(r, ray_t))
+            return true;
+        bool left_ready = left->ready(r, ray_t); // asks both sides, so both start loading
+        return (right == left || right->ready(r, ray_t)) && left_ready;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+    aabb bounding_box_at(float time) const override { return is_moving ? lerp(bbox0, bbox1, time) : bbox; }
+};
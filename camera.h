@@ -2,6 +2,22 @@
 
 #include "rtw.h"
 #include "hittable.h"
+#include "bdpt.h"
+#include "environment.h"
+#include "light_tree.h"
+#include "photon_map.h"
+#include "radiance_cache.h"
+#include "wavefront.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
 
 class camera
 {
@@ -11,6 +27,9 @@ public:
     int samples_per_pixel = 10;
     int max_depth = 10;
     color background;
+    // When set, rays that escape the scene see this map instead of the background colour, and it is
+    // sampled as a light together with the emitters in the scene.
+    shared_ptr<environment_light> environment;
 
     float vfov = 90;
     vec3 lookfrom = vec3(0, 0, 0);
@@ -20,31 +39,186 @@ public:
     float defocus_angle = 0;
     float focus_dist = 10;
 
-    void render(const hittable &world)
+    // Write raw 8-bit RGB triplets with no header instead of an ASCII PPM, so consecutive frames
+    // can be piped straight into a video encoder.
+    bool raw_output = false;
+    // Trace with the batched wavefront_integrator instead of the depth-first ray_color recursion.
+    // Its stages run on all threads; it does not sample lights or use caches or photon maps, and
+    // progressive and band modes take precedence. Rays into unloaded chunks are deferred.
+    bool wavefront = false;
+    // Trace with the bidirectional bdpt_integrator on all threads. Needs a pinhole camera
+    // (defocus_angle 0); progressive and band modes, light trees, caches and photon maps do not apply.
+    bool bidirectional = false;
+
+    // Progressive mode: a coarse 1 spp pass first, then passes of doubling sample counts until
+    // samples_per_pixel is reached or time_budget seconds (0 for no limit) have been spent.
+    bool progressive = false;
+    float time_budget = 0;
+    // Receives the current image as one raw rgb24 frame after every progressive pass.
+    std::ostream *preview = nullptr;
+    // Once this is raised, pixels not yet sampled by the depth-first integrator are left black, so
+    // a render that is no longer wanted runs out within a few pixels.
+    const std::atomic<bool> *cancel = nullptr;
+
+    // Streaming mode for images too large to hold in memory: when non-zero, the image is rendered in
+    // bands of this many rows on all threads and each band is written and freed as soon as every band
+    // above it is out. At most a few bands per thread are resident at once.
+    int band_height = 0;
+
+    // At each diffuse bounce, also send a shadow ray towards one light picked from a light tree over
+    // the scene's emitters, or towards the environment map (next-event estimation). Emitters hit by the following scattered ray are
+    // then not counted again. Only used by the depth-first integrator.
+    bool sample_lights = true;
+
+    // Radiance caching for diffuse interreflection: when cache_resolution is non-zero, every diffuse
+    // path vertex feeds a hash grid with cells 1/cache_resolution of the scene's size, and paths end
+    // at their second diffuse hit if its cell already holds cache_min_samples estimates. Biased;
+    // raise both knobs for closer agreement with the uncached result. Only used by the depth-first
+    // integrator.
+    int cache_resolution = 0;
+    int cache_min_samples = 16;
+
+    // Caustics from a photon map: before rendering, this many photons are traced from the emitters
+    // and those reaching diffuse surfaces through glass, mirrors or fog are stored. Diffuse hits then
+    // add their density estimate over caustic_radius (0 for 1/500 of the scene's size), and camera
+    // paths stop counting emitters reached through the same kind of non-diffuse chain.
+    int caustic_photons = 0;
+    float caustic_radius = 0;
+
+    void render(const hittable &world) { render(world, std::cout); }
+
+    void render(const hittable &world, std::ostream &out)
     {
-        initialize();
+        trace_span span("render", "render");
+        prepare(world);
         // Render
-        std::cout << "P3\n"
-                  << image_width << ' ' << image_height << "\n255\n";
+        if (!raw_output)
+            out << "P3\n"
+                << image_width << ' ' << image_height << "\n255\n";
 
-        for (int j = 0; j < image_height; j++)
+        if (bidirectional)
         {
-            std::clog << "Scanlines remaining: " << image_height - j << std::endl;
+            render_bidirectional(world, out);
+            return;
+        }
+
+        if (progressive)
+        {
+            render_progressive(world, out);
+            return;
+        }
+
+        if (band_height > 0)
+        {
+            render_streaming(world, out);
+            return;
+        }
+
+        if (wavefront)
+        {
+            wavefront_integrator integrator;
+            integrator.max_depth = max_depth;
+            integrator.background = background;
+            integrator.environment = environment.get();
+
+            std::vector<color> image;
+            integrator.render(world, image_width, image_height, samples_per_pixel,
+                              [this](int i, int j)
+                              { return get_ray<feature_all>(i, j); },
+                              image);
+            ray_count.value += integrator.rays_traced;
+            trace_span write("image write", "io");
+            for (const auto &px : image)
+                write_pixel(out, pixel_sample_scale * px);
+            std::clog << "Done." << std::endl;
+            return;
+        }
+
+        // Rows are shared out on the global thread pool and the image written once all are done.
+        std::vector<color> image(size_t(image_width) * image_height);
+        std::atomic<int> rows_left{image_height};
+        thread_pool::global().parallel_for(image_height, [&](size_t j)
+                                           {
+            trace_span row("row", "render", int64_t(j));
             for (int i = 0; i < image_width; i++)
-            {
-                color px(0, 0, 0);
-                for (int sample = 0; sample < samples_per_pixel; sample++)
-                {
-                    ray r = get_ray(i, j);
-                    px += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_sample_scale * px);
-            }
+                image[j * image_width + i] = sample_pixel(i, int(j), samples_per_pixel, world);
+            std::clog << "Scanlines remaining: " << --rows_left << std::endl; });
+
+        trace_span write("image write", "io");
+        for (const auto &px : image)
+            write_pixel(out, pixel_sample_scale * px);
+        std::clog << "Done." << std::endl;
+    }
+
+    // Renders the same world through every camera in views, writing view k's image to *outs[k].
+    // The rows of all views are shared out on the global thread pool as one batch, so small or
+    // cheap views do not leave threads idle. Each view traces with the depth-first integrator at
+    // its own settings; its progressive, band, wavefront and bidirectional modes are ignored. The
+    // light tree, photon map and radiance cache are built once, for the first view, and shared:
+    // the other views take its light sampling, caustic and cache settings.
+    static void render_views(const hittable &world, std::vector<camera> &views, const std::vector<std::ostream *> &outs)
+    {
+        trace_span span("render views", "render", int64_t(views.size()));
+        std::vector<size_t> first_row(views.size() + 1, 0);
+        for (size_t k = 0; k < views.size(); k++)
+        {
+            views[k].prepare(world, k > 0 ? &views[0] : nullptr);
+            first_row[k + 1] = first_row[k] + views[k].image_height;
+        }
+
+        std::vector<std::vector<color>> images(views.size());
+        for (size_t k = 0; k < views.size(); k++)
+            images[k].resize(size_t(views[k].image_width) * views[k].image_height);
+        std::atomic<size_t> rows_left{first_row.back()};
+        thread_pool::global().parallel_for(first_row.back(), [&](size_t row)
+                                           {
+            size_t k = std::upper_bound(first_row.begin(), first_row.end(), row) - first_row.begin() - 1;
+            const camera &view = views[k];
+            int j = int(row - first_row[k]);
+            trace_span span("row", "render", int64_t(row));
+            for (int i = 0; i < view.image_width; i++)
+                images[k][size_t(j) * view.image_width + i] = view.sample_pixel(i, j, view.samples_per_pixel, world);
+            std::clog << "Scanlines remaining: " << --rows_left << std::endl; });
+
+        trace_span write("image write", "io");
+        for (size_t k = 0; k < views.size(); k++)
+        {
+            const camera &view = views[k];
+            std::ostream &out = *outs[k];
+            if (!view.raw_output)
+                out << "P3\n"
+                    << view.image_width << ' ' << view.image_height << "\n255\n";
+            for (const auto &px : images[k])
+                view.write_pixel(out, view.pixel_sample_scale * px);
         }
         std::clog << "Done." << std::endl;
     }
 
+    int get_image_height() const { return std::max(1, int(image_width / aspect_ratio)); }
+    // Rays traced (camera and scattered) since this camera was created.
+    uint64_t rays_traced() const { return ray_count.value.load(); }
+
 private:
+    // Copyable wrapper so camera stays a plain value type.
+    struct counter
+    {
+        std::atomic<uint64_t> value{0};
+        counter() = default;
+        counter(const counter &other) : value(other.value.load()) {}
+        counter &operator=(const counter &other)
+        {
+            value = other.value.load();
+            return *this;
+        }
+    };
+    mutable counter ray_count;
+    // sample_pixel_kernel instantiated for the features of the scene being rendered.
+    using pixel_kernel = color (camera::*)(int, int, int, const hittable &) const;
+    pixel_kernel sample_kernel = &camera::sample_pixel_kernel<feature_all>;
+    shared_ptr<light_tree> lights = make_shared<light_tree>(); // shared by copies and by the views of render_views
+    shared_ptr<radiance_cache> cache;
+    shared_ptr<photon_map> caustics;
+
     int image_height;
     float pixel_sample_scale;
     vec3 camera_center;
@@ -55,6 +229,243 @@ private:
     vec3 defocus_disk_u;
     vec3 defocus_disk_v;
 
+    // Sets up the view and everything render() needs from the world before tracing. With shared,
+    // the light tree, photon map and radiance cache are taken from that already prepared camera
+    // of the same world, along with the settings they were built with, instead of being rebuilt.
+    void prepare(const hittable &world, const camera *shared = nullptr)
+    {
+        initialize();
+        if (shared)
+        {
+            sample_lights = shared->sample_lights;
+            caustic_photons = shared->caustic_photons;
+            caustic_radius = shared->caustic_radius;
+            cache_resolution = shared->cache_resolution;
+            cache_min_samples = shared->cache_min_samples;
+            lights = shared->lights;
+            caustics = shared->caustics;
+            cache = shared->cache;
+            select_kernel(world);
+            return;
+        }
+
+        lights = make_shared<light_tree>();
+        if (sample_lights)
+        {
+            trace_span build("light tree build", "build");
+            lights->build(world);
+        }
+        caustics.reset();
+        if (caustic_photons > 0)
+        {
+            float radius = caustic_radius;
+            if (radius <= 0)
+            {
+                auto bounds = world.bounding_box();
+                radius = bounds.axis_interval(bounds.longest_axis()).size() / 500;
+            }
+            auto start = std::chrono::steady_clock::now();
+            trace_span build("photon map build", "build");
+            caustics = make_shared<photon_map>();
+            caustics->build(world, caustic_photons, radius);
+            std::clog << "Caustic photons: " << caustics->size() << " of " << caustic_photons << " stored in "
+                      << std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+        }
+        cache.reset();
+        if (cache_resolution > 0)
+        {
+            cache = make_shared<radiance_cache>(world.bounding_box(), cache_resolution);
+            cache->min_samples = cache_min_samples;
+        }
+        select_kernel(world);
+    }
+
+    void write_pixel(std::ostream &out, const color &pixel_color) const
+    {
+        if (raw_output)
+            write_color_raw(out, pixel_color);
+        else
+            write_color(out, pixel_color);
+    }
+
+    template <typename PixelColor>
+    void write_preview(PixelColor &&pixel_color) const
+    {
+        if (!preview)
+            return;
+        trace_span span("preview write", "io");
+        for (int j = 0; j < image_height; j++)
+            for (int i = 0; i < image_width; i++)
+                write_color_raw(*preview, pixel_color(i, j));
+        preview->flush();
+    }
+
+    void render_progressive(const hittable &world, std::ostream &out)
+    {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        auto seconds_since = [](clock::time_point t)
+        { return std::chrono::duration<float>(clock::now() - t).count(); };
+        auto &pool = thread_pool::global();
+
+        // Coarse pass: one sample per block of pixels, so the first preview frame is ready almost
+        // immediately. It is only shown until the first full-resolution pass lands.
+        const int block = 8;
+        int coarse_width = (image_width + block - 1) / block;
+        int coarse_height = (image_height + block - 1) / block;
+        std::vector<color> coarse(size_t(coarse_width) * coarse_height);
+        pool.parallel_for(coarse_height, [&](size_t cj)
+                          {
+            trace_span row("coarse row", "render", int64_t(cj));
+            for (int ci = 0; ci < coarse_width; ci++)
+            {
+                int i = std::min(ci * block + block / 2, image_width - 1);
+                int j = std::min(int(cj) * block + block / 2, image_height - 1);
+                coarse[cj * coarse_width + ci] = sample_pixel(i, j, 1, world);
+            } });
+        auto coarse_pixel = [&](int i, int j)
+        { return coarse[(j / block) * coarse_width + i / block]; };
+        write_preview(coarse_pixel);
+        std::clog << "Coarse pass: " << 1000 * seconds_since(start) << " ms" << std::endl;
+
+        std::vector<color> sum(size_t(image_width) * image_height, color(0, 0, 0));
+        int samples_done = 0;
+        int pass_samples = 1;
+        float seconds_per_sample = 0;
+
+        while (samples_done < samples_per_pixel)
+        {
+            int n = std::min(pass_samples, samples_per_pixel - samples_done);
+            if (time_budget > 0)
+            {
+                float remaining = time_budget - seconds_since(start);
+                if (samples_done > 0)
+                    n = std::min(n, int(remaining / seconds_per_sample));
+                if (n < 1 || remaining <= 0)
+                    break;
+            }
+
+            auto pass_start = clock::now();
+            trace_span pass("pass", "render", samples_done + n);
+            pool.parallel_for(image_height, [&](size_t j)
+                              {
+                trace_span row("row", "render", int64_t(j));
+                for (int i = 0; i < image_width; i++)
+                    sum[j * image_width + i] += sample_pixel(i, int(j), n, world); });
+            seconds_per_sample = seconds_since(pass_start) / n;
+            samples_done += n;
+            pass_samples *= 2;
+
+            float scale = 1.0f / samples_done;
+            write_preview([&](int i, int j)
+                          { return scale * sum[size_t(j) * image_width + i]; });
+            std::clog << "Pass done: " << samples_done << " spp after " << seconds_since(start) << " s" << std::endl;
+        }
+
+        float scale = samples_done > 0 ? 1.0f / samples_done : 0;
+        trace_span write("image write", "io");
+        for (int j = 0; j < image_height; j++)
+            for (int i = 0; i < image_width; i++)
+                write_pixel(out, samples_done > 0 ? scale * sum[size_t(j) * image_width + i] : coarse_pixel(i, j));
+        std::clog << "Done." << std::endl;
+    }
+
+    void render_bidirectional(const hittable &world, std::ostream &out)
+    {
+        if (defocus_angle > 0)
+            std::clog << "Bidirectional rendering ignores depth of field." << std::endl;
+        bdpt_integrator integrator(world, {camera_center, -w, pixel00_loc, pixel_delta_u, pixel_delta_v, image_width, image_height},
+                                   max_depth - 1);
+        integrator.background = background;
+        integrator.environment = environment.get();
+
+        std::vector<color> image(size_t(image_width) * image_height);
+        std::atomic<int> rows_left{image_height};
+        thread_pool::global().parallel_for(image_height, [&](size_t j)
+                                           {
+            trace_span row("row", "render", int64_t(j));
+            bdpt_integrator::paths paths;
+            uint64_t rays = 0;
+            for (int i = 0; i < image_width; i++)
+                for (int sample = 0; sample < samples_per_pixel; sample++)
+                    image[j * image_width + i] += integrator.sample(get_ray<feature_motion_blur>(i, int(j)), paths, rays);
+            ray_count.value.fetch_add(rays, std::memory_order_relaxed);
+            std::clog << "Scanlines remaining: " << --rows_left << std::endl; });
+
+        trace_span write("image write", "io");
+        for (int j = 0; j < image_height; j++)
+            for (int i = 0; i < image_width; i++)
+                write_pixel(out, pixel_sample_scale * (image[size_t(j) * image_width + i] + integrator.splats.get(i, j)));
+        std::clog << "Done." << std::endl;
+    }
+
+    void render_streaming(const hittable &world, std::ostream &out)
+    {
+        auto &pool = thread_pool::global();
+        int band_count = (image_height + band_height - 1) / band_height;
+        // Bands may run this far ahead of the writer before workers wait for it to catch up.
+        int window = 2 * int(pool.size());
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::map<int, std::vector<color>> finished; // reorder buffer, keyed by band index
+        int next_band = 0;
+        int written = 0;
+        int running = int(std::min<size_t>(pool.size(), band_count));
+
+        for (int w = 0; w < running; w++)
+            pool.submit([&]
+                        {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (next_band < band_count)
+                {
+                    int band = next_band++;
+                    changed.wait(lock, [&] { return band < written + window; });
+                    lock.unlock();
+
+                    int first_row = band * band_height;
+                    int rows = std::min(band_height, image_height - first_row);
+                    std::vector<color> pixels(size_t(rows) * image_width);
+                    {
+                        trace_span span("band", "render", band);
+                        for (int j = 0; j < rows; j++)
+                            for (int i = 0; i < image_width; i++)
+                                pixels[size_t(j) * image_width + i] =
+                                    pixel_sample_scale * sample_pixel(i, first_row + j, samples_per_pixel, world);
+                    }
+
+                    lock.lock();
+                    finished.emplace(band, std::move(pixels));
+                    changed.notify_all();
+                }
+                if (--running == 0)
+                    changed.notify_all(); });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (written < band_count)
+        {
+            changed.wait(lock, [&]
+                         { return finished.count(written) > 0; });
+            auto pixels = std::move(finished[written]);
+            finished.erase(written);
+            lock.unlock();
+
+            {
+                trace_span span("band write", "io", written);
+                for (const auto &px : pixels)
+                    write_pixel(out, px);
+            }
+            std::clog << "Scanlines remaining: " << image_height - std::min(image_height, (written + 1) * band_height) << std::endl;
+
+            lock.lock();
+            written++;
+            changed.notify_all();
+        }
+        changed.wait(lock, [&]
+                     { return running == 0; });
+        std::clog << "Done." << std::endl;
+    }
+
     void initialize()
     {
         image_height = int(image_width / aspect_ratio);
@@ -87,15 +498,35 @@ private:
         defocus_disk_v = v * defocus_radius;
     }
 
+    // Picks the sample kernel for the features the scene and camera actually use. Volumes cost
+    // nothing outside constant_medium::hit, so they do not get kernels of their own.
+    void select_kernel(const hittable &world)
+    {
+        unsigned used = world.features() | (defocus_angle > 0 ? unsigned(feature_depth_of_field) : 0u);
+        static const pixel_kernel kernels[] = {
+            &camera::sample_pixel_kernel<0>,
+            &camera::sample_pixel_kernel<1>,
+            &camera::sample_pixel_kernel<2>,
+            &camera::sample_pixel_kernel<3>,
+            &camera::sample_pixel_kernel<4>,
+            &camera::sample_pixel_kernel<5>,
+            &camera::sample_pixel_kernel<6>,
+            &camera::sample_pixel_kernel<7>,
+        };
+        sample_kernel = kernels[used & (feature_motion_blur | feature_depth_of_field | feature_emission)];
+    }
+
+    template <unsigned Features>
     ray get_ray(int i, int j) const
     {
         auto offset = sample_square();
         auto pixel_sample = pixel00_loc +
                             ((i + offset.x) * pixel_delta_u) +
                             ((j + offset.y) * pixel_delta_v);
-        auto ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample();
+        auto ray_origin = (Features & feature_depth_of_field) ? defocus_disk_sample() : camera_center;
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_float();
+        // Without motion blur every object sits at its time-0 position anyway.
+        float ray_time = (Features & feature_motion_blur) ? random_float() : 0;
 
         return ray(ray_origin, ray_direction, ray_time);
     }
@@ -113,23 +544,155 @@ private:
         return vec3(random_float() - 0.5, random_float() - 0.5, 0);
     }
 
-    color ray_color(const ray &r, int depth, const hittable &world)
+    // Sum of `samples` path samples through pixel (i, j).
+    color sample_pixel(int i, int j, int samples, const hittable &world) const
+    {
+        if (cancel && cancel->load(std::memory_order_relaxed))
+            return color(0, 0, 0);
+        return (this->*sample_kernel)(i, j, samples, world);
+    }
+
+    template <unsigned Features>
+    color sample_pixel_kernel(int i, int j, int samples, const hittable &world) const
+    {
+        uint64_t rays = 0;
+        color px(0, 0, 0);
+        for (int sample = 0; sample < samples; sample++)
+            px += ray_color<Features>(get_ray<Features>(i, j), max_depth, world, rays);
+        ray_count.value.fetch_add(rays, std::memory_order_relaxed);
+        return px;
+    }
+
+    color miss_color(const ray &r) const
+    {
+        return environment ? environment->value(r.direction()) : background;
+    }
+
+    // Radiance arriving at rec from one sampled light, divided by the light's pick probability and
+    // direction pdf. Multiplied by the albedo this is the direct lighting of a Lambertian surface.
+    // With an environment map present it is picked half of the time instead of a scene emitter.
+    color direct_light(const hitrecord &rec, float time, const hittable &world, uint64_t &rays) const
+    {
+        float pmf = 1;
+        if (environment && !lights->empty())
+        {
+            pmf = 0.5f;
+            if (random_float() < 0.5f)
+                return direct_environment(rec, time, world, rays) / pmf;
+        }
+        else if (environment)
+            return direct_environment(rec, time, world, rays);
+
+        float tree_pmf;
+        const hittable *light = lights->sample(rec.position, rec.normal, tree_pmf);
+        if (!light)
+            return color(0, 0, 0);
+        pmf *= tree_pmf;
+
+        vec3 direction = light->random(rec.position);
+        float cosine = dot(direction, rec.normal);
+        if (cosine <= 0)
+            return color(0, 0, 0);
+
+        ray shadow(rec.position, direction, time);
+        hitrecord light_rec;
+        if (!light->hit(shadow, interval(0.001, infinity), light_rec))
+            return color(0, 0, 0);
+        float pdf = light->pdf_value(rec.position, direction);
+        if (pdf <= 0)
+            return color(0, 0, 0);
+
+        rays++;
+        if (world.occluded(shadow, interval(0.001, light_rec.t * 0.999f)))
+            return color(0, 0, 0);
+
+        color emitted = light_rec.mat->emitted(light_rec.u, light_rec.v, light_rec.position);
+        return emitted * (cosine / (direction.length() * PI * pdf * pmf));
+    }
+
+    color direct_environment(const hitrecord &rec, float time, const hittable &world, uint64_t &rays) const
+    {
+        vec3 direction;
+        float pdf;
+        if (!environment->sample(direction, pdf))
+            return color(0, 0, 0);
+        float cosine = dot(direction, rec.normal);
+        if (cosine <= 0)
+            return color(0, 0, 0);
+
+        rays++;
+        if (world.occluded(ray(rec.position, direction, time), interval(0.001, infinity)))
+            return color(0, 0, 0);
+        return environment->value(direction) * (cosine / (PI * pdf));
+    }
+
+    // How the photon map relates to the current path segment.
+    enum caustic_state
+    {
+        no_caustics,       // no photon lookup on this path yet
+        caustics_gathered, // the last diffuse vertex added photon map caustics
+        caustic_chain      // ... and non-diffuse bounces have followed it: emitters hit now are caustics
+    };
+
+    // light_sampled: the previous vertex already sampled the emitters in the light tree and the
+    // environment directly. diffuse_bounces: diffuse vertices on the path so far. Features selects
+    // the code compiled in: without feature_emission, hits never look for emitted light.
+    template <unsigned Features>
+    color ray_color(const ray &r, int depth, const hittable &world, uint64_t &rays, bool light_sampled = false,
+                    int diffuse_bounces = 0, caustic_state caustic = no_caustics) const
     {
         if (depth <= 0)
             return color(0, 0, 0);
+        rays++;
         hitrecord record;
         if (!world.hit(r, interval(0.001, infinity), record))
         {
-            return background;
+            if (light_sampled && environment)
+                return color(0, 0, 0);
+            return miss_color(r);
         }
+
+        bool diffuse = record.mat->is_diffuse();
+        color cached;
+        if (cache && diffuse && diffuse_bounces > 0 && cache->lookup(record.position, record.normal, cached))
+            return cached;
+
         ray scattered;
         color attenuation;
-        color color_from_emission = record.mat->emitted(record.u, record.v, record.position);
+        color color_from_emission(0, 0, 0);
+        if constexpr ((Features & feature_emission) != 0)
+        {
+            bool sampled_already = (light_sampled && lights->contains(record.object)) ||
+                                   (caustic == caustic_chain && caustics && caustics->emits_from(record.object));
+            if (!sampled_already)
+                color_from_emission = record.mat->emitted(record.u, record.v, record.position);
+        }
 
         if (!record.mat->scatter(r, record, attenuation, scattered))
             return color_from_emission;
 
-        color color_from_scatter = attenuation * ray_color(scattered, depth - 1, world);
-        return color_from_emission + color_from_scatter;
+        // No light sample on the last bounce: the scattered ray would not be traced either, so
+        // this keeps the path length limit the same as without light sampling.
+        bool sample_direct = depth > 1 && sample_lights && (!lights->empty() || environment) && diffuse;
+        if (sample_direct)
+            color_from_emission += attenuation * direct_light(record, r.time(), world, rays);
+
+        caustic_state next_caustic = caustic == no_caustics ? no_caustics : caustic_chain;
+        if (diffuse)
+        {
+            next_caustic = no_caustics;
+            if (caustics && depth > 1)
+            {
+                color_from_emission += attenuation / PI * caustics->flux_density(record.position, record.normal);
+                next_caustic = caustics_gathered;
+            }
+        }
+
+        color color_from_scatter = attenuation * ray_color<Features>(scattered, depth - 1, world, rays, sample_direct,
+                                                           diffuse_bounces + diffuse, next_caustic);
+        color result = color_from_emission + color_from_scatter;
+        if (cache && diffuse)
+            cache->record(record.position, record.normal, result);
+        return result;
     }
-};
\ No newline at end of file
+};
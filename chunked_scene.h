@@ -0,0 +1,324 @@
+#pragma once
+
+#include "rtw.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "lazy_bvh.h"
+#include "scene.h"
+#include "snapshot.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Scenes too large to keep in memory, stored on disk as spatially coherent chunks. Each chunk is
+// a snapshot (see snapshot.h) with its own BVH; a directory holds the chunks and an index naming
+// them. chunked_scene keeps a BVH over the chunks' bounds and their materials and emitters
+// resident, and maps a chunk's geometry only when a ray enters it. Mapped chunks are held under a
+// byte budget, and the least recently used ones are unmapped to make room.
+//
+// Rays that reach a chunk that is not mapped load it on the spot. Batch integrators can avoid
+// that stall through ready(): it queues the chunks a ray will need for a background loader and
+// answers false until they are in, so the ray can wait its turn while others are traced. The
+// wavefront integrator (--wavefront) does this; the depth-first modes load synchronously.
+
+// Splits every object of s (looking inside nested hittable_lists) into chunks of at most
+// chunk_objects and writes them with s's camera to dir. On failure returns false and says why.
+inline bool write_chunks(const scene &s, const std::string &dir, size_t chunk_objects, std::string &error)
+{
+    hittable_list objects;
+    auto gather = [&](auto &self, const hittable_list &list) -> void
+    {
+        for (const auto &object : list.objects)
+            if (auto *inner = dynamic_cast<const hittable_list *>(object.get()))
+                self(self, *inner);
+            else
+                objects.add(object);
+    };
+    gather(gather, s.world);
+    if (objects.objects.empty())
+    {
+        error = "the scene is empty";
+        return false;
+    }
+
+    mkdir(dir.c_str(), 0755);
+    lazy_bvh groups(objects, bvh_build::fast, chunk_objects);
+    for (size_t g = 0; g < groups.group_count(); g++)
+    {
+        const auto &members = groups.group_objects(g);
+        scene chunk;
+        chunk.cam = s.cam;
+        chunk.world.add(make_shared<bvh_node>(members, 0, members.size()));
+        if (!write_snapshot(chunk, dir + "/chunk" + std::to_string(g) + ".snap", error))
+            return false;
+    }
+    std::ofstream index(dir + "/index");
+    index << "rtchunks 1 " << groups.group_count() << '\n';
+    if (!index)
+    {
+        error = "could not write " + dir + "/index";
+        return false;
+    }
+    return true;
+}
+
+class chunked_scene : public hittable
+{
+    struct slot
+    {
+        mapped_scene geometry;
+        aabb bounds;
+        size_t bytes = 0;
+        std::shared_mutex use; // shared while tracing, exclusive while mapping or unmapping
+        std::atomic<bool> resident{false};
+        std::atomic<bool> requested{false};
+        std::atomic<uint64_t> last_used{0};
+        std::atomic<bool> failed{false};
+        std::atomic<int> pins{0}; // rays about to use the chunk; it is not evicted while any are
+    };
+
+    // Stands in for one chunk in the resident BVH.
+    class chunk : public hittable
+    {
+        chunked_scene &owner;
+        size_t index;
+
+    public:
+        chunk(chunked_scene &owner, size_t index) : owner(owner), index(index) {}
+
+        bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+        {
+            if (!owner.slots[index]->bounds.hit(r, ray_t))
+                return false;
+            return owner.trace(index, [&](const mapped_scene &geometry)
+                               {
+                if (!geometry.hit(r, ray_t, rec))
+                    return false;
+                if (rec.object == &geometry)
+                    rec.object = this; // the mapping may be gone by the time the caller looks
+                return true; });
+        }
+        bool occluded(const ray &r, interval ray_t) const override
+        {
+            if (!owner.slots[index]->bounds.hit(r, ray_t))
+                return false;
+            return owner.trace(index, [&](const mapped_scene &geometry)
+                               { return geometry.occluded(r, ray_t); });
+        }
+        bool ready(const ray &r, interval ray_t) const override
+        {
+            const slot &s = *owner.slots[index];
+            if (s.resident.load(std::memory_order_acquire) || s.failed || !s.bounds.hit(r, ray_t))
+                return true;
+            owner.request(index);
+            return false;
+        }
+        aabb bounding_box() const override { return owner.slots[index]->bounds; }
+        unsigned features() const override { return owner.slots[index]->geometry.features(); }
+    };
+
+    std::vector<std::unique_ptr<slot>> slots;
+    std::vector<shared_ptr<chunk>> chunks;
+    shared_ptr<bvh_node> top;
+    std::vector<const hittable *> lights;
+
+    size_t budget = 0;
+    size_t resident_bytes = 0;
+    std::mutex residency; // serializes mapping and unmapping
+    std::atomic<uint64_t> clock{0};
+    std::atomic<size_t> load_count{0}, eviction_count{0}, request_count{0};
+
+    std::mutex queue_mutex;
+    std::condition_variable queued;
+    std::vector<size_t> queue;
+    bool stopping = false;
+    std::thread loader;
+
+    // Calls trace with chunk index mapped, loading it first if need be. The chunk is pinned from
+    // before the load until trace returns, so other threads loading their own chunks cannot evict
+    // it in between; with too many chunks pinned, loads go over the budget rather than wait.
+    template <typename Trace>
+    bool trace(size_t index, Trace &&trace)
+    {
+        slot &s = *slots[index];
+        s.pins.fetch_add(1, std::memory_order_acq_rel);
+        struct unpin
+        {
+            slot &s;
+            ~unpin() { s.pins.fetch_sub(1, std::memory_order_acq_rel); }
+        } pinned{s};
+        while (true)
+        {
+            {
+                std::shared_lock<std::shared_mutex> use(s.use);
+                if (s.failed)
+                    return false;
+                if (s.resident.load(std::memory_order_acquire))
+                {
+                    s.last_used.store(clock.fetch_add(1, std::memory_order_relaxed), std::memory_order_relaxed);
+                    return trace(s.geometry);
+                }
+            }
+            load(index);
+        }
+    }
+
+    void load(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(residency);
+        slot &s = *slots[index];
+        if (s.resident || s.failed)
+            return;
+        while (resident_bytes + s.bytes > budget && evict_except(index))
+        {
+        }
+
+        trace_span span("chunk load", "io", int64_t(index));
+        std::unique_lock<std::shared_mutex> use(s.use);
+        std::string error;
+        if (!s.geometry.remap(error))
+        {
+            std::clog << error << std::endl;
+            s.failed = true;
+            return;
+        }
+        s.geometry.prefetch();
+        resident_bytes += s.bytes;
+        load_count++;
+        s.resident.store(true, std::memory_order_release);
+    }
+
+    // Unmaps the least recently used unpinned chunk other than keep. False if there is none.
+    bool evict_except(size_t keep)
+    {
+        std::vector<slot *> candidates;
+        for (size_t i = 0; i < slots.size(); i++)
+            if (i != keep && slots[i]->resident && slots[i]->pins.load(std::memory_order_acquire) == 0)
+                candidates.push_back(slots[i].get());
+        std::sort(candidates.begin(), candidates.end(), [](const slot *a, const slot *b)
+                  { return a->last_used.load(std::memory_order_relaxed) < b->last_used.load(std::memory_order_relaxed); });
+
+        for (slot *victim : candidates)
+        {
+            std::unique_lock<std::shared_mutex> use(victim->use); // waits for rays inside it to leave
+            if (victim->pins.load(std::memory_order_acquire) > 0)
+                continue; // pinned since it was picked
+            victim->resident = false;
+            victim->geometry.unmap();
+            resident_bytes -= victim->bytes;
+            eviction_count++;
+            return true;
+        }
+        return false;
+    }
+
+    void request(size_t index) const
+    {
+        auto *self = const_cast<chunked_scene *>(this);
+        if (slots[index]->requested.exchange(true))
+            return;
+        self->request_count++;
+        std::lock_guard<std::mutex> lock(self->queue_mutex);
+        self->queue.push_back(index);
+        self->queued.notify_one();
+    }
+
+    void load_requests()
+    {
+        tracer::name_thread("chunk loader");
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        while (true)
+        {
+            queued.wait(lock, [this]
+                        { return stopping || !queue.empty(); });
+            if (stopping)
+                return;
+            size_t index = queue.back();
+            queue.pop_back();
+            lock.unlock();
+            load(index);
+            slots[index]->requested = false;
+            lock.lock();
+        }
+    }
+
+public:
+    chunked_scene() = default;
+    chunked_scene(const chunked_scene &) = delete;
+    chunked_scene &operator=(const chunked_scene &) = delete;
+    ~chunked_scene() override
+    {
+        if (!loader.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        loader.join();
+    }
+
+    // Opens the chunks written to dir by write_chunks(), keeping at most budget_bytes of geometry
+    // mapped. Each chunk is mapped once up front for its bounds, materials and emitters.
+    bool open(const std::string &dir, size_t budget_bytes, std::string &error)
+    {
+        std::ifstream index(dir + "/index");
+        std::string magic;
+        int version = 0;
+        size_t count = 0;
+        if (!(index >> magic >> version >> count) || magic != "rtchunks" || version != 1 || count == 0)
+        {
+            error = "no chunk index in " + dir;
+            return false;
+        }
+
+        budget = budget_bytes;
+        std::vector<shared_ptr<hittable>> proxies;
+        for (size_t i = 0; i < count; i++)
+        {
+            slots.push_back(std::make_unique<slot>());
+            slot &s = *slots.back();
+            if (!s.geometry.open(dir + "/chunk" + std::to_string(i) + ".snap", error))
+                return false;
+            s.bounds = s.geometry.bounding_box();
+            s.bytes = s.geometry.mapped_size();
+            s.geometry.collect_lights(lights);
+            s.geometry.unmap();
+            chunks.push_back(make_shared<chunk>(*this, i));
+            proxies.push_back(chunks.back());
+        }
+        top = make_shared<bvh_node>(proxies, 0, proxies.size());
+        loader = std::thread([this]
+                             { load_requests(); });
+        return true;
+    }
+
+    // Camera settings saved with the chunks.
+    void apply(camera &cam) const { slots[0]->geometry.apply(cam); }
+
+    size_t chunk_count() const { return slots.size(); }
+    size_t loads() const { return load_count; }
+    size_t evictions() const { return eviction_count; }
+    // Chunks queued for the background loader by ready().
+    size_t requests() const { return request_count; }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override { return top->hit(r, ray_t, rec); }
+    bool occluded(const ray &r, interval ray_t) const override { return top->occluded(r, ray_t); }
+    // Queues every unmapped chunk r passes through, found by walking the chunk BVH; true only if
+    // none of them had to be.
+    bool ready(const ray &r, interval ray_t) const override { return top->ready(r, ray_t); }
+    aabb bounding_box() const override { return top->bounding_box(); }
+    void collect_lights(std::vector<const hittable *> &out) const override { out.insert(out.end(), lights.begin(), lights.end()); }
+    unsigned features() const override { return top->features(); }
+};
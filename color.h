@@ -3,24 +3,26 @@
 #include "vec3.h"
 
 using color = vec3;
+inline float luminance(const color &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
 inline float linear_to_gamma(float linear_component)
 {
     if (linear_component > 0)
         return sqrt(linear_component);
     return 0;
 }
-void write_color(std::ostream &out, const color &pixel_color)
+inline unsigned char to_byte(float linear_component)
 {
-    auto r = pixel_color.x;
-    auto g = pixel_color.y;
-    auto b = pixel_color.z;
-
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
-
     static const interval intensity(0.0, 0.999);
-    out << int(255.999 * intensity.clamp(r)) << ' '
-        << int(255.999 * intensity.clamp(g)) << ' '
-        << int(255.999 * intensity.clamp(b)) << '\n';
+    return (unsigned char)(255.999 * intensity.clamp(linear_to_gamma(linear_component)));
+}
+void write_color(std::ostream &out, const color &pixel_color)
+{
+    out << int(to_byte(pixel_color.x)) << ' '
+        << int(to_byte(pixel_color.y)) << ' '
+        << int(to_byte(pixel_color.z)) << '\n';
+}
+void write_color_raw(std::ostream &out, const color &pixel_color)
+{
+    const char rgb[3] = {char(to_byte(pixel_color.x)), char(to_byte(pixel_color.y)), char(to_byte(pixel_color.z))};
+    out.write(rgb, 3);
 }
\ No newline at end of file
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "rtw.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// bvh_node's hierarchy flattened into an array of 20-byte nodes. Each node stores the boxes of
+// its two children as 8-bit fractions of its own box, rounded outwards, and refers to each child
+// by index. A child is either another node or, with leaf_bit set, an object. Traversal decodes
+// the child boxes from the parent's decoded box, so every box it tests contains the exact one,
+// and the whole tree is several times smaller than the bvh_node objects it came from.
+//
+// Moving objects keep their swept boxes, so this suits static scenes best; it cannot be refit.
+class compact_bvh : public hittable
+{
+    struct node
+    {
+        uint8_t lo[2][3], hi[2][3];
+        uint32_t child[2];
+    };
+
+    static constexpr uint32_t leaf_bit = 0x80000000u;
+    static constexpr uint32_t no_child = ~0u;
+
+    std::vector<node> nodes;
+    std::vector<shared_ptr<hittable>> objects;
+    aabb bbox;
+
+    static float step(const interval &parent) { return parent.size() * (1.0f / 254.99f); }
+
+    // Bound a code stands for. The end codes are the parent's own bounds exactly: far from the
+    // origin, p.min + 255 * s can round to below p.max.
+    static float bound(const interval &p, float s, int code)
+    {
+        if (code == 0)
+            return p.min;
+        if (code == 255)
+            return p.max;
+        return p.min + code * s;
+    }
+
+    static aabb decode(const aabb &parent, const uint8_t lo[3], const uint8_t hi[3])
+    {
+        interval axes[3];
+        for (int a = 0; a < 3; a++)
+        {
+            const interval &p = parent.axis_interval(a);
+            float s = step(p);
+            axes[a] = interval(bound(p, s, lo[a]), bound(p, s, hi[a]));
+        }
+        return aabb(axes[0], axes[1], axes[2]);
+    }
+
+    // Smallest codes whose decoded box still contains box.
+    static void encode(const aabb &parent, const aabb &box, uint8_t lo[3], uint8_t hi[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            const interval &p = parent.axis_interval(a);
+            const interval &b = box.axis_interval(a);
+            float s = step(p);
+            int l = 0, h = 255;
+            if (s > 0)
+            {
+                l = std::clamp(int(std::floor((b.min - p.min) / s)), 0, 255);
+                h = std::clamp(int(std::ceil((b.max - p.min) / s)), l, 255);
+            }
+            while (l > 0 && bound(p, s, l) > b.min)
+                l--;
+            while (h < 255 && bound(p, s, h) < b.max)
+                h++;
+            lo[a] = uint8_t(l);
+            hi[a] = uint8_t(h);
+        }
+    }
+
+    // Fills in side of node index with object, whose box is quantized against parent (the box
+    // traversal will have decoded for that node).
+    void link(uint32_t index, int side, const shared_ptr<hittable> &object, const aabb &parent)
+    {
+        encode(parent, object->bounding_box(), nodes[index].lo[side], nodes[index].hi[side]);
+        aabb decoded = decode(parent, nodes[index].lo[side], nodes[index].hi[side]);
+
+        auto *inner = dynamic_cast<const bvh_node *>(object.get());
+        if (inner && inner->left == inner->right)
+        {
+            link(index, side, inner->left, parent);
+            return;
+        }
+        if (!inner)
+        {
+            nodes[index].child[side] = leaf_bit | uint32_t(objects.size());
+            objects.push_back(object);
+            return;
+        }
+        uint32_t child = uint32_t(nodes.size());
+        nodes.push_back({{}, {}, {no_child, no_child}});
+        nodes[index].child[side] = child;
+        link(child, 0, inner->left, decoded);
+        link(child, 1, inner->right, decoded);
+    }
+
+    bool hit_node(uint32_t index, const aabb &box, const ray &r, interval ray_t, hitrecord &rec) const
+    {
+        const node &n = nodes[index];
+        bool hit_anything = false;
+        for (int side = 0; side < 2; side++)
+        {
+            uint32_t child = n.child[side];
+            if (child == no_child)
+                continue;
+            aabb child_box = decode(box, n.lo[side], n.hi[side]);
+            if (!child_box.hit(r, ray_t))
+                continue;
+            if (child & leaf_bit ? objects[child & ~leaf_bit]->hit(r, ray_t, rec)
+                                 : hit_node(child, child_box, r, ray_t, rec))
+            {
+                hit_anything = true;
+                ray_t.max = rec.t;
+            }
+        }
+        return hit_anything;
+    }
+    bool node_occluded(uint32_t index, const aabb &box, const ray &r, interval ray_t) const
+    {
+        const node &n = nodes[index];
+        for (int side = 0; side < 2; side++)
+        {
+            uint32_t child = n.child[side];
+            if (child == no_child)
+                continue;
+            aabb child_box = decode(box, n.lo[side], n.hi[side]);
+            if (!child_box.hit(r, ray_t))
+                continue;
+            if (child & leaf_bit ? objects[child & ~leaf_bit]->occluded(r, ray_t)
+                                 : node_occluded(child, child_box, r, ray_t))
+                return true;
+        }
+        return false;
+    }
+
+public:
+    // Builds a bvh_node over list with mode and keeps only its compacted form.
+    compact_bvh(const hittable_list &list, bvh_build mode = bvh_build::quality)
+    {
+        auto tree = make_shared<bvh_node>(list, mode);
+        bbox = tree->bounding_box();
+        objects.reserve(list.objects.size());
+        nodes.reserve(list.objects.size());
+        nodes.push_back({{}, {}, {no_child, no_child}});
+        if (tree->left == tree->right)
+            link(0, 0, tree->left, bbox);
+        else
+        {
+            link(0, 0, tree->left, bbox);
+            link(0, 1, tree->right, bbox);
+        }
+        nodes.shrink_to_fit();
+    }
+
+    // Bytes taken by the hierarchy itself (nodes and object references).
+    size_t memory_size() const { return nodes.size() * sizeof(node) + objects.size() * sizeof(objects[0]); }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+    {
+        return bbox.hit(r, ray_t) && hit_node(0, bbox, r, ray_t, rec);
+    }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return bbox.hit(r, ray_t) && node_occluded(0, bbox, r, ray_t);
+    }
+    aabb bounding_box() const override { return bbox; }
+    void collect_lights(std::vector<const hittable *> &lights) const override
+    {
+        for (const auto &object : objects)
+            object->collect_lights(lights);
+    }
+    unsigned features() const override
+    {
+        unsigned used = 0;
+        for (const auto &object : objects)
+            used |= object->features();
+        return used;
+    }
+};
@@ -11,6 +11,35 @@ class constant_medium : public hittable
     double neg_inv_density;
     shared_ptr<material> phase_function;
 
+    // Samples where along r within ray_t a scattering event happens, if at all.
+    bool scatter_distance(const ray &r, interval ray_t, float &t) const
+    {
+        interval inside;
+        if (!boundary->inside_span(r, inside))
+            return false;
+
+        if (inside.min < ray_t.min)
+            inside.min = ray_t.min;
+        if (inside.max > ray_t.max)
+            inside.max = ray_t.max;
+
+        if (inside.min >= inside.max)
+            return false;
+
+        if (inside.min < 0)
+            inside.min = 0;
+
+        auto ray_length = r.direction().length();
+        auto distance_inside_boundary = (inside.max - inside.min) * ray_length;
+        auto hit_distance = neg_inv_density * log(random_float());
+
+        if (hit_distance > distance_inside_boundary)
+            return false;
+
+        t = inside.min + hit_distance / ray_length;
+        return true;
+    }
+
 public:
     constant_medium(shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
         : boundary(boundary), neg_inv_density(-1 / density),
@@ -23,41 +52,41 @@ public:
           phase_function(make_shared<isotropic>(albedo))
     {
     }
+    constant_medium(scene_arena &arena, shared_ptr<hittable> boundary, double density, shared_ptr<texture> tex)
+        : boundary(boundary), neg_inv_density(-1 / density),
+          phase_function(arena.make<isotropic>(tex))
+    {
+    }
+    constant_medium(scene_arena &arena, shared_ptr<hittable> boundary, double density, const color &albedo)
+        : boundary(boundary), neg_inv_density(-1 / density),
+          phase_function(arena.make<isotropic>(albedo))
+    {
+    }
     bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
     {
-        hitrecord rec1, rec2;
-        if (!boundary->hit(r, interval::universe, rec1))
-            return false;
-
-        if (!boundary->hit(r, interval(rec1.t + 0.0001, infinity), rec2))
-            return false;
-
-        if (rec1.t < ray_t.min)
-            rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max)
-            rec2.t = ray_t.max;
-
-        if (rec1.t >= rec2.t)
+        float t;
+        if (!scatter_distance(r, ray_t, t))
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
-
-        auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-        auto hit_distance = neg_inv_density * log(random_float());
-
-        if (hit_distance > distance_inside_boundary)
-            return false;
-
-        rec.t = rec1.t + hit_distance / ray_length;
+        rec.t = t;
         rec.position = r.at(rec.t);
 
         rec.normal = vec3(1, 0, 0); // arbitrary
         rec.frontface = true;       // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
+        rec.object = this;
 
         return true;
     }
+    // A shadow ray is blocked where a scattered ray would have scattered, so averaged over many
+    // rays this gives the medium's transmittance.
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        float t;
+        return scatter_distance(r, ray_t, t);
+    }
     aabb bounding_box() const override { return boundary->bounding_box(); }
+    aabb bounding_box_at(float time) const override { return boundary->bounding_box_at(time); }
+    // The boundary's own material is never shaded; only its motion matters.
+    unsigned features() const override { return feature_volumes | (boundary->features() & feature_motion_blur); }
 };
\ No newline at end of file
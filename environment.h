@@ -0,0 +1,194 @@
+#pragma once
+
+#include "rtw.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Linear float RGB image, row 0 at the top.
+struct float_image
+{
+    int width = 0, height = 0;
+    std::vector<color> pixels;
+
+    float_image() = default;
+    float_image(int width, int height) : width(width), height(height), pixels(size_t(width) * height, color(0, 0, 0)) {}
+
+    color &at(int i, int j) { return pixels[size_t(j) * width + i]; }
+    const color &at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+
+    // Reads a colour Portable Float Map (PF). Returns false on failure.
+    bool load_pfm(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string magic;
+        float scale;
+        if (!(in >> magic >> width >> height >> scale) || magic != "PF" || width <= 0 || height <= 0)
+            return false;
+        in.get();
+
+        std::vector<float> data(size_t(width) * height * 3);
+        if (!in.read(reinterpret_cast<char *>(data.data()), data.size() * sizeof(float)))
+            return false;
+
+        // A negative scale marks little-endian data; PFM rows run bottom to top.
+        uint16_t probe = 1;
+        bool host_little = *reinterpret_cast<unsigned char *>(&probe) == 1;
+        if ((scale < 0) != host_little)
+            for (auto &f : data)
+            {
+                uint32_t bits;
+                std::memcpy(&bits, &f, 4);
+                bits = __builtin_bswap32(bits);
+                std::memcpy(&f, &bits, 4);
+            }
+
+        pixels.resize(size_t(width) * height);
+        for (int j = 0; j < height; j++)
+            for (int i = 0; i < width; i++)
+            {
+                const float *p = &data[(size_t(height - 1 - j) * width + i) * 3];
+                at(i, j) = color(p[0], p[1], p[2]);
+            }
+        return true;
+    }
+
+    // Writes a colour Portable Float Map in the host's byte order. Returns false on failure.
+    bool save_pfm(const std::string &path) const
+    {
+        uint16_t probe = 1;
+        bool host_little = *reinterpret_cast<const unsigned char *>(&probe) == 1;
+        std::ofstream out(path, std::ios::binary);
+        out << "PF\n" << width << ' ' << height << '\n' << (host_little ? "-1" : "1") << '\n';
+        for (int j = height; j-- > 0;)
+            for (int i = 0; i < width; i++)
+            {
+                const color &c = at(i, j);
+                float p[3] = {c.x, c.y, c.z};
+                out.write(reinterpret_cast<const char *>(p), sizeof(p));
+            }
+        return bool(out);
+    }
+};
+
+// Distant light surrounding the scene, given as a latitude-longitude radiance map: u runs around the
+// y axis, v from straight up (v = 0) to straight down. Directions are importance sampled in
+// proportion to texel luminance times the solid angle of the texel, through a marginal CDF over rows
+// and a conditional CDF over the texels of each row, so a small bright sun is found by light
+// sampling instead of by chance.
+class environment_light
+{
+    float_image image;
+    std::vector<float> row_cdf;    // height + 1 entries
+    std::vector<float> column_cdf; // (width + 1) per row
+    float total_weight = 0;
+
+    static float sample_cdf(const float *cdf, int n, float u, int &index)
+    {
+        index = int(std::upper_bound(cdf, cdf + n + 1, u * cdf[n]) - cdf) - 1;
+        index = std::clamp(index, 0, n - 1);
+        float lo = cdf[index], hi = cdf[index + 1];
+        return hi > lo ? (u * cdf[n] - lo) / (hi - lo) : 0.5f;
+    }
+
+    float weight(int i, int j) const
+    {
+        float sin_theta = sin(PI * (j + 0.5f) / image.height);
+        return luminance(image.at(i, j)) * sin_theta;
+    }
+
+    void texel(const vec3 &direction, float &u, float &v) const
+    {
+        auto d = unit(direction);
+        u = (atan2(-d.z, d.x) + PI) / (2 * PI);
+        v = acos(std::clamp(d.y, -1.0f, 1.0f)) / PI;
+    }
+
+public:
+    explicit environment_light(float_image map) : image(std::move(map))
+    {
+        int w = image.width, h = image.height;
+        column_cdf.assign(size_t(w + 1) * h, 0);
+        row_cdf.assign(h + 1, 0);
+        for (int j = 0; j < h; j++)
+        {
+            float *cdf = &column_cdf[size_t(w + 1) * j];
+            for (int i = 0; i < w; i++)
+                cdf[i + 1] = cdf[i] + weight(i, j);
+            row_cdf[j + 1] = row_cdf[j] + cdf[w];
+        }
+        total_weight = row_cdf[h];
+    }
+
+    color value(const vec3 &direction) const
+    {
+        float u, v;
+        texel(direction, u, v);
+        int i = std::min(int(u * image.width), image.width - 1);
+        int j = std::min(int(v * image.height), image.height - 1);
+        return image.at(i, j);
+    }
+
+    // Random direction towards the environment and its solid-angle density. Returns false for an
+    // entirely black map.
+    bool sample(vec3 &direction, float &pdf) const
+    {
+        if (total_weight <= 0)
+            return false;
+
+        int i, j;
+        float dv = sample_cdf(row_cdf.data(), image.height, random_float(), j);
+        float du = sample_cdf(&column_cdf[size_t(image.width + 1) * j], image.width, random_float(), i);
+        float u = (i + du) / image.width;
+        float v = (j + dv) / image.height;
+
+        float theta = v * PI, phi = u * 2 * PI - PI;
+        float sin_theta = sin(theta);
+        if (sin_theta <= 0)
+            return false;
+        direction = vec3(sin_theta * cos(phi), cos(theta), -sin_theta * sin(phi));
+        pdf = weight(i, j) / total_weight * image.width * image.height / (2 * PI * PI * sin_theta);
+        return pdf > 0;
+    }
+
+    // Density with which sample() produces this direction.
+    float pdf_value(const vec3 &direction) const
+    {
+        if (total_weight <= 0)
+            return 0;
+        float u, v;
+        texel(direction, u, v);
+        int i = std::min(int(u * image.width), image.width - 1);
+        int j = std::min(int(v * image.height), image.height - 1);
+        float sin_theta = sin(v * PI);
+        if (sin_theta <= 0)
+            return 0;
+        return weight(i, j) / total_weight * image.width * image.height / (2 * PI * PI * sin_theta);
+    }
+};
+
+// Procedural clear sky as a lat-long map: a horizon-to-zenith gradient, dark ground below the
+// horizon and a sun disk of the given angular radius (degrees) around sun_direction.
+inline float_image sky_image(int width, int height, const vec3 &sun_direction, float sun_radius,
+                             const color &sun, const color &zenith, const color &horizon)
+{
+    float_image sky(width, height);
+    auto to_sun = unit(sun_direction);
+    float cos_sun = cos(to_radians(sun_radius));
+    for (int j = 0; j < height; j++)
+        for (int i = 0; i < width; i++)
+        {
+            float theta = PI * (j + 0.5f) / height, phi = 2 * PI * (i + 0.5f) / width - PI;
+            vec3 d(sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi));
+            color c = d.y > 0 ? horizon + (zenith - horizon) * sqrt(d.y) : 0.3f * horizon;
+            if (dot(d, to_sun) >= cos_sun)
+                c = sun;
+            sky.at(i, j) = c;
+        }
+    return sky;
+}
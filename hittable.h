@@ -1,11 +1,18 @@
 #pragma once
 #include "aabb.h"
+#include "snapshot_format.h"
+#include <vector>
+
 class material;
+class hittable;
 struct hitrecord
 {
     vec3 position;
     vec3 normal;
-    shared_ptr<material> mat;
+    const material *mat = nullptr;
+    // Object that was hit (the outermost transform for instanced primitives), so light sampling can
+    // recognise emitters it already samples.
+    const hittable *object;
     float t;
     float u;
     float v;
@@ -18,12 +25,81 @@ struct hitrecord
     }
 };
 
+// What light sampling needs to know about an emitter: where it is, which way it faces (its surface
+// normals lie within spread radians of axis, pi for every direction) and roughly how much power it
+// emits.
+struct emitter_info
+{
+    aabb bounds;
+    vec3 axis;
+    float spread;
+    float power;
+};
+
+// Optional rendering features a scene may use. The camera picks a sample kernel compiled for
+// exactly the features present, so scenes without them skip the work entirely.
+enum render_feature : unsigned
+{
+    feature_motion_blur = 1,    // objects that move during the shutter interval
+    feature_depth_of_field = 2, // set by the camera, not the scene
+    feature_emission = 4,       // emissive materials
+    feature_volumes = 8,        // participating media
+    feature_all = 15
+};
+
 class hittable
 {
 public:
     virtual ~hittable() = default;
     virtual bool hit(const ray &r, interval ray_t, hitrecord &record) const = 0;
+    // Whether anything lies along r within ray_t, for shadow and visibility rays. Stops at the first
+    // intersection found and fills in nothing; the default falls back to hit().
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hitrecord rec;
+        return hit(r, ray_t, rec);
+    }
     virtual aabb bounding_box() const = 0;
+    // Bounds at a single shutter time in [0, 1]. Moving objects override this so acceleration
+    // structures can interpolate their start and end boxes instead of using the swept union.
+    virtual aabb bounding_box_at(float time) const { return bounding_box(); }
+    // Recompute cached bounds bottom-up after a transform below this object has changed.
+    virtual void refit() {}
+    // For closed objects: the range of ray parameters between entering and leaving the object (the
+    // entry may lie behind the origin). The default finds both with two closest-hit queries;
+    // analytic shapes can answer directly.
+    virtual bool inside_span(const ray &r, interval &inside) const
+    {
+        hitrecord rec1, rec2;
+        if (!hit(r, interval::universe, rec1))
+            return false;
+        if (!hit(r, interval(rec1.t + 0.0001, infinity), rec2))
+            return false;
+        inside = interval(rec1.t, rec2.t);
+        return true;
+    }
+
+    // Emitters that direct light sampling can sample: primitives with an emissive material add
+    // themselves, containers recurse. Transformed or moving emitters are left out and keep being
+    // found by scattered rays alone.
+    virtual void collect_lights(std::vector<const hittable *> &lights) const {}
+    virtual emitter_info emitter() const { return {bounding_box(), vec3(0, 0, 1), PI, 0}; }
+    // Direction from origin towards a random point on this object, and the solid-angle density of
+    // sampling a given direction that way.
+    virtual vec3 random(const vec3 &origin) const { return vec3(1, 0, 0); }
+    virtual float pdf_value(const vec3 &origin, const vec3 &direction) const { return 0; }
+    // Uniformly distributed point on the surface, for emitting photons: fills in position, outward
+    // normal, mat, u, v and object, and returns the surface area (0 if not supported).
+    virtual float sample_surface(hitrecord &rec) const { return 0; }
+    // render_feature bits this object and everything below it need. Unknown objects claim all.
+    virtual unsigned features() const { return feature_all; }
+    // Whether r can be traced over ray_t without waiting for geometry to be read in. Objects that
+    // stream their data may start loading what r needs and answer false, so that batch
+    // integrators can come back to r later instead of stalling on it.
+    virtual bool ready(const ray &r, interval ray_t) const { return true; }
+    // Appends this object and everything below it to a scene snapshot. False for objects a
+    // snapshot cannot hold, which is the default.
+    virtual bool save(snapshot_writer &out) const { return false; }
 };
 
 class translate : public hittable
@@ -37,34 +113,50 @@ public:
     {
         bbox = object->bounding_box() + offset;
     }
+    const vec3 &get_offset() const { return offset; }
+    void set_offset(const vec3 &new_offset) { offset = new_offset; }
+    void refit() override
+    {
+        object->refit();
+        bbox = object->bounding_box() + offset;
+    }
     aabb bounding_box() const override
     {
         return bbox;
     }
+    aabb bounding_box_at(float time) const override
+    {
+        return object->bounding_box_at(time) + offset;
+    }
     bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
     {
         ray offset_r(r.origin() - offset, r.direction(), r.time());
         if (!object->hit(offset_r, ray_t, rec))
             return false;
         rec.position += offset;
+        rec.object = this;
         return true;
     }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
+    bool inside_span(const ray &r, interval &inside) const override
+    {
+        return object->inside_span(ray(r.origin() - offset, r.direction(), r.time()), inside);
+    }
+    unsigned features() const override { return object->features(); }
 };
 
 class rotate_y : public hittable
 {
     shared_ptr<hittable> object;
     float sin_theta, cos_theta;
+    float angle;
     aabb bbox;
 
-public:
-    rotate_y(shared_ptr<hittable> object, float angle) : object(object)
+    void update_bbox()
     {
-        auto radians = to_radians(angle);
-
-        sin_theta = sin(radians);
-        cos_theta = cos(radians);
-
         bbox = object->bounding_box();
 
         vec3 min(infinity, infinity, infinity);
@@ -96,9 +188,31 @@ public:
         bbox = aabb(min, max);
     }
 
+public:
+    rotate_y(shared_ptr<hittable> object, float angle) : object(object)
+    {
+        set_angle(angle);
+        update_bbox();
+    }
+
+    float get_angle() const { return angle; }
+    void set_angle(float new_angle)
+    {
+        angle = new_angle;
+        auto radians = to_radians(angle);
+
+        sin_theta = sin(radians);
+        cos_theta = cos(radians);
+    }
+    void refit() override
+    {
+        object->refit();
+        update_bbox();
+    }
+
     aabb bounding_box() const override { return bbox; }
 
-    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+    ray to_object(const ray &r) const
     {
         auto origin = r.origin();
         auto direction = r.direction();
@@ -109,9 +223,22 @@ public:
         direction.x = cos_theta * r.direction().x - sin_theta * r.direction().z;
         direction.z = sin_theta * r.direction().x + cos_theta * r.direction().z;
 
-        ray rotated_r(origin, direction, r.time());
+        return ray(origin, direction, r.time());
+    }
 
-        if (!object->hit(rotated_r, ray_t, rec))
+    bool inside_span(const ray &r, interval &inside) const override
+    {
+        return object->inside_span(to_object(r), inside);
+    }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(to_object(r), ray_t);
+    }
+    unsigned features() const override { return object->features(); }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+    {
+        if (!object->hit(to_object(r), ray_t, rec))
             return false;
 
         auto p = rec.position;
@@ -124,6 +251,7 @@ public:
 
         rec.position = p;
         rec.normal = normal;
+        rec.object = this;
 
         return true;
     }
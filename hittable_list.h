@@ -7,7 +7,7 @@
 
 class hittable_list : public hittable
 {
-    aabb bbox;
+    aabb bbox = aabb::empty;
 
 public:
     std::vector<shared_ptr<hittable>> objects;
@@ -15,11 +15,18 @@ public:
     hittable_list(shared_ptr<hittable> object)
     {
         add(object);
-        bbox = aabb(bbox, object->bounding_box());
     }
 
-    void clear() { objects.clear(); }
-    void add(shared_ptr<hittable> object) { objects.push_back(object); }
+    void clear()
+    {
+        objects.clear();
+        bbox = aabb::empty;
+    }
+    void add(shared_ptr<hittable> object)
+    {
+        objects.push_back(object);
+        bbox = aabb(bbox, object->bounding_box());
+    }
 
     bool hit(const ray &r, interval ray_t, hitrecord &record) const override
     {
@@ -39,5 +46,64 @@ public:
         }
         return hit_anything;
     }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+            if (object->occluded(r, ray_t))
+                return true;
+        return false;
+    }
     aabb bounding_box() const override { return bbox; }
+    bool ready(const ray &r, interval ray_t) const override
+    {
+        bool all = true;
+        for (const auto &object : objects)
+            all &= object->ready(r, ray_t); // asks every object, so all of them start loading
+        return all;
+    }
+    void collect_lights(std::vector<const hittable *> &lights) const override
+    {
+        for (const auto &object : objects)
+            object->collect_lights(lights);
+    }
+    unsigned features() const override
+    {
+        unsigned used = 0;
+        for (const auto &object : objects)
+            used |= object->features();
+        return used;
+    }
+    // Saved as a chain of group nodes, which the snapshot walks in the same order as hit() does.
+    bool save(snapshot_writer &out) const override
+    {
+        if (objects.empty())
+        {
+            out.empty();
+            return true;
+        }
+        for (size_t i = 0; i + 1 < objects.size(); i++)
+        {
+            size_t node = out.group();
+            if (!objects[i]->save(out))
+                return false;
+            out.second_child(node);
+        }
+        return objects.back()->save(out);
+    }
+    void refit() override
+    {
+        bbox = aabb::empty;
+        for (const auto &object : objects)
+        {
+            object->refit();
+            bbox = aabb(bbox, object->bounding_box());
+        }
+    }
+    aabb bounding_box_at(float time) const override
+    {
+        aabb box = aabb::empty;
+        for (const auto &object : objects)
+            box = aabb(box, object->bounding_box_at(time));
+        return box;
+    }
 };
\ No newline at end of file
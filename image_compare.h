@@ -0,0 +1,124 @@
+#pragma once
+
+#include "rtw.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// 8-bit RGB image as written by camera::render, used to compare renders against references.
+struct image8
+{
+    int width = 0, height = 0;
+    std::vector<unsigned char> rgb;
+
+    // Reads ASCII (P3) or binary (P6) PPM files with a maxval of 255. Returns false on failure.
+    bool load_ppm(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string magic;
+        int maxval;
+        if (!(in >> magic >> width >> height >> maxval) || maxval != 255 || width <= 0 || height <= 0)
+            return false;
+
+        rgb.resize(size_t(width) * height * 3);
+        if (magic == "P6")
+        {
+            in.get();
+            return bool(in.read(reinterpret_cast<char *>(rgb.data()), rgb.size()));
+        }
+        if (magic != "P3")
+            return false;
+        for (auto &c : rgb)
+        {
+            int v;
+            if (!(in >> v))
+                return false;
+            c = (unsigned char)v;
+        }
+        return true;
+    }
+
+    color pixel(int i, int j) const
+    {
+        i = i < 0 ? 0 : i >= width ? width - 1 : i;
+        j = j < 0 ? 0 : j >= height ? height - 1 : j;
+        const unsigned char *p = &rgb[(size_t(j) * width + i) * 3];
+        return color(p[0], p[1], p[2]) / 255.0f;
+    }
+};
+
+// Root-mean-square difference over all channels, in [0, 1].
+inline float image_rmse(const image8 &a, const image8 &b)
+{
+    double sum = 0;
+    for (size_t k = 0; k < a.rgb.size(); k++)
+    {
+        double d = (a.rgb[k] - b.rgb[k]) / 255.0;
+        sum += d * d;
+    }
+    return float(sqrt(sum / a.rgb.size()));
+}
+
+// Relative difference in overall brightness. Sample noise largely averages out over the whole image,
+// so this catches small systematic (biased) changes that per-pixel metrics cannot see under noise.
+inline float image_mean_shift(const image8 &a, const image8 &b)
+{
+    double sum_a = 0, sum_b = 0;
+    for (size_t k = 0; k < a.rgb.size(); k++)
+    {
+        sum_a += a.rgb[k];
+        sum_b += b.rgb[k];
+    }
+    return float(fabs(sum_a - sum_b) / std::max(sum_a, 1.0));
+}
+
+// Cheap FLIP-style perceptual difference. Both images are viewed from a distance first: averaged
+// over blocks of block x block pixels and then low-pass filtered, a crude stand-in for the eye's
+// contrast sensitivity that makes per-pixel sample noise matter far less than a change in overall
+// brightness or colour. The mean CIELAB colour difference is reported normalized to roughly [0, 1].
+inline float image_perceptual_error(const image8 &a, const image8 &b, int block = 4)
+{
+    auto to_lab = [](color c)
+    {
+        auto linear = [](float v)
+        { return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f); };
+        float r = linear(c.x), g = linear(c.y), bl = linear(c.z);
+        float x = (0.4124f * r + 0.3576f * g + 0.1805f * bl) / 0.9505f;
+        float y = 0.2126f * r + 0.7152f * g + 0.0722f * bl;
+        float z = (0.0193f * r + 0.1192f * g + 0.9505f * bl) / 1.089f;
+        auto f = [](float t)
+        { return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116.0f; };
+        return vec3(116 * f(y) - 16, 500 * (f(x) - f(y)), 200 * (f(y) - f(z)));
+    };
+
+    int w = (a.width + block - 1) / block, h = (a.height + block - 1) / block;
+    auto downsample = [&](const image8 &img)
+    {
+        std::vector<color> small(size_t(w) * h, color(0, 0, 0));
+        for (int j = 0; j < img.height; j++)
+            for (int i = 0; i < img.width; i++)
+                small[size_t(j / block) * w + i / block] += img.pixel(i, j) / float(block * block);
+        return small;
+    };
+    auto blurred = [&](const std::vector<color> &img, int i, int j)
+    {
+        static const float weights[3] = {0.25f, 0.5f, 0.25f};
+        color sum(0, 0, 0);
+        for (int dj = -1; dj <= 1; dj++)
+            for (int di = -1; di <= 1; di++)
+            {
+                int x = std::clamp(i + di, 0, w - 1), y = std::clamp(j + dj, 0, h - 1);
+                sum += weights[di + 1] * weights[dj + 1] * img[size_t(y) * w + x];
+            }
+        return sum;
+    };
+
+    auto small_a = downsample(a), small_b = downsample(b);
+    double total = 0;
+    for (int j = 0; j < h; j++)
+        for (int i = 0; i < w; i++)
+            total += (to_lab(blurred(small_a, i, j)) - to_lab(blurred(small_b, i, j))).length();
+    return float(total / (double(w) * h) / 100.0);
+}
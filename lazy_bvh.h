@@ -0,0 +1,207 @@
+#pragma once
+
+#include "rtw.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// BVH whose lower levels are built on demand. Construction only sorts the objects into spatially
+// coherent groups and builds a bvh_node over the groups' bounding boxes; each group builds its own
+// subtree the first time a ray enters its box (one thread builds, concurrent rays wait for it).
+// Geometry no ray ever reaches is never built, so the first pixels of a huge scene seen only in
+// part appear long before a full build would have finished.
+class lazy_bvh : public hittable
+{
+    // A group of objects standing in for the subtree over them until something needs it.
+    class deferred : public hittable
+    {
+        std::vector<shared_ptr<hittable>> objects;
+        bvh_build mode;
+        aabb bbox;
+        // Bounds at the start and end of the shutter, interpolated for moving groups as bvh_node does.
+        aabb bbox0, bbox1;
+        bool is_moving = false;
+        std::once_flag once;
+        std::atomic<const bvh_node *> built{nullptr};
+        shared_ptr<bvh_node> subtree;
+
+        const bvh_node &tree()
+        {
+            const bvh_node *node = built.load(std::memory_order_acquire);
+            if (node)
+                return *node;
+            std::call_once(once, [this]
+                           {
+                subtree = make_shared<bvh_node>(objects, 0, objects.size(), mode);
+                objects = std::vector<shared_ptr<hittable>>(); // now owned by the subtree
+                built.store(subtree.get(), std::memory_order_release); });
+            return *subtree;
+        }
+
+        void set_bounds(const aabb &swept, const aabb &start, const aabb &end)
+        {
+            bbox = swept;
+            bbox0 = start;
+            bbox1 = end;
+            is_moving = !(bbox0.x.min == bbox1.x.min && bbox0.x.max == bbox1.x.max &&
+                          bbox0.y.min == bbox1.y.min && bbox0.y.max == bbox1.y.max &&
+                          bbox0.z.min == bbox1.z.min && bbox0.z.max == bbox1.z.max);
+        }
+        aabb box_at(float time) const { return is_moving ? lerp(bbox0, bbox1, time) : bbox; }
+
+    public:
+        deferred(std::vector<shared_ptr<hittable>> objects, const aabb &bbox, const aabb &bbox0, const aabb &bbox1,
+                 bvh_build mode)
+            : objects(std::move(objects)), mode(mode)
+        {
+            set_bounds(bbox, bbox0, bbox1);
+        }
+
+        bool is_built() const { return built.load(std::memory_order_acquire) != nullptr; }
+        const std::vector<shared_ptr<hittable>> &pending() const { return objects; }
+
+        bool hit(const ray &r, interval ray_t, hitrecord &rec) const override
+        {
+            if (!box_at(r.time()).hit(r, ray_t))
+                return false;
+            return const_cast<deferred *>(this)->tree().hit(r, ray_t, rec);
+        }
+        bool occluded(const ray &r, interval ray_t) const override
+        {
+            if (!box_at(r.time()).hit(r, ray_t))
+                return false;
+            return const_cast<deferred *>(this)->tree().occluded(r, ray_t);
+        }
+        aabb bounding_box() const override { return bbox; }
+        aabb bounding_box_at(float time) const override { return box_at(time); }
+
+        // Bookkeeping over the whole scene goes straight to the objects rather than forcing a build.
+        void collect_lights(std::vector<const hittable *> &lights) const override
+        {
+            if (is_built())
+                subtree->collect_lights(lights);
+            else
+                for (const auto &object : objects)
+                    object->collect_lights(lights);
+        }
+        unsigned features() const override
+        {
+            if (is_built())
+                return subtree->features();
+            unsigned used = 0;
+            for (const auto &object : objects)
+                used |= object->features();
+            return used;
+        }
+        void refit() override
+        {
+            if (is_built())
+            {
+                subtree->refit();
+                set_bounds(subtree->bounding_box(), subtree->bounding_box_at(0), subtree->bounding_box_at(1));
+                return;
+            }
+            aabb swept = aabb::empty, start = aabb::empty, end = aabb::empty;
+            for (const auto &object : objects)
+            {
+                object->refit();
+                swept = aabb(swept, object->bounding_box());
+                start = aabb(start, object->bounding_box_at(0));
+                end = aabb(end, object->bounding_box_at(1));
+            }
+            set_bounds(swept, start, end);
+        }
+    };
+
+    struct entry
+    {
+        shared_ptr<hittable> object;
+        aabb bounds, bounds0, bounds1;
+        float centroid[3];
+    };
+
+    shared_ptr<bvh_node> top;
+    std::vector<shared_ptr<deferred>> groups;
+
+    // Median splits along the widest centroid axis until ranges are no bigger than group_size.
+    void partition(std::vector<entry> &entries, size_t start, size_t end, size_t group_size, bvh_build mode)
+    {
+        if (end - start <= group_size)
+        {
+            std::vector<shared_ptr<hittable>> objects;
+            objects.reserve(end - start);
+            aabb bbox = aabb::empty, bbox0 = aabb::empty, bbox1 = aabb::empty;
+            for (size_t i = start; i < end; i++)
+            {
+                objects.push_back(std::move(entries[i].object));
+                bbox = aabb(bbox, entries[i].bounds);
+                bbox0 = aabb(bbox0, entries[i].bounds0);
+                bbox1 = aabb(bbox1, entries[i].bounds1);
+            }
+            groups.push_back(make_shared<deferred>(std::move(objects), bbox, bbox0, bbox1, mode));
+            return;
+        }
+
+        float lo[3] = {infinity, infinity, infinity}, hi[3] = {-infinity, -infinity, -infinity};
+        for (size_t i = start; i < end; i++)
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = std::min(lo[a], entries[i].centroid[a]);
+                hi[a] = std::max(hi[a], entries[i].centroid[a]);
+            }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (hi[a] - lo[a] > hi[axis] - lo[axis])
+                axis = a;
+
+        size_t mid = start + (end - start) / 2;
+        std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+                         [axis](const entry &a, const entry &b)
+                         { return a.centroid[axis] < b.centroid[axis]; });
+        partition(entries, start, mid, group_size, mode);
+        partition(entries, mid, end, group_size, mode);
+    }
+
+public:
+    // Objects are split into groups of at most group_size, each of which becomes a lazily built
+    // bvh_node subtree using mode.
+    lazy_bvh(const hittable_list &list, bvh_build mode = bvh_build::quality, size_t group_size = 4096)
+    {
+        std::vector<entry> entries(list.objects.size());
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const auto &object = list.objects[i];
+            aabb mid = object->bounding_box_at(0.5f);
+            entries[i] = {object, object->bounding_box(), object->bounding_box_at(0), object->bounding_box_at(1),
+                          {mid.x.min + mid.x.max, mid.y.min + mid.y.max, mid.z.min + mid.z.max}};
+        }
+        partition(entries, 0, entries.size(), std::max<size_t>(group_size, 1), mode);
+
+        std::vector<shared_ptr<hittable>> roots(groups.begin(), groups.end());
+        top = make_shared<bvh_node>(roots, 0, roots.size(), mode);
+    }
+
+    // Subtrees built so far, out of the total.
+    size_t built_groups() const
+    {
+        return std::count_if(groups.begin(), groups.end(), [](const shared_ptr<deferred> &g)
+                             { return g->is_built(); });
+    }
+    size_t group_count() const { return groups.size(); }
+    // Objects and bounds of group g, for as long as it has not been built.
+    const std::vector<shared_ptr<hittable>> &group_objects(size_t g) const { return groups[g]->pending(); }
+    aabb group_bounds(size_t g) const { return groups[g]->bounding_box(); }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override { return top->hit(r, ray_t, rec); }
+    bool occluded(const ray &r, interval ray_t) const override { return top->occluded(r, ray_t); }
+    aabb bounding_box() const override { return top->bounding_box(); }
+    aabb bounding_box_at(float time) const override { return top->bounding_box_at(time); }
+    void collect_lights(std::vector<const hittable *> &lights) const override { top->collect_lights(lights); }
+    unsigned features() const override { return top->features(); }
+    void refit() override { top->refit(); }
+};
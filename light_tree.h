@@ -0,0 +1,203 @@
+#pragma once
+
+#include "rtw.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+// Bounding hierarchy over the scene's emitters for picking one light per shading point. Every node
+// keeps the bounds, total power and orientation cone of the emitters below it; sampling walks down
+// from the root choosing a child in proportion to a conservative estimate of how much it can light
+// the shading point, so nearby or bright lights are picked far more often than distant ones and the
+// cost per sample grows with the depth of the tree rather than the number of lights.
+class light_tree
+{
+    struct node
+    {
+        aabb bounds;
+        vec3 axis;
+        float spread;
+        float power;
+        int left = -1;
+        int right = -1;
+        const hittable *light = nullptr; // set on leaves only
+    };
+
+    std::vector<node> nodes;
+    std::vector<const hittable *> sorted_lights;
+
+    static vec3 center(const aabb &box)
+    {
+        return 0.5f * vec3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max);
+    }
+
+    // Smallest cone containing both normal cones.
+    static void merge_cones(const node &a, const node &b, vec3 &axis, float &spread)
+    {
+        const node &wide = a.spread >= b.spread ? a : b;
+        const node &narrow = a.spread >= b.spread ? b : a;
+        float cos_d = std::clamp(dot(wide.axis, narrow.axis), -1.0f, 1.0f);
+        float theta_d = acos(cos_d);
+        axis = wide.axis;
+        if (std::min(theta_d + narrow.spread, PI) <= wide.spread)
+        {
+            spread = wide.spread;
+            return;
+        }
+
+        spread = 0.5f * (wide.spread + theta_d + narrow.spread);
+        vec3 ortho = narrow.axis - cos_d * wide.axis;
+        if (spread >= PI || ortho.length_squared() < 1e-12f)
+        {
+            spread = PI;
+            return;
+        }
+        float theta_r = spread - wide.spread;
+        axis = unit(cos(theta_r) * wide.axis + sin(theta_r) * unit(ortho));
+    }
+
+    int build(std::vector<node> &leaves, size_t start, size_t end)
+    {
+        int index = int(nodes.size());
+        if (end - start == 1)
+        {
+            nodes.push_back(leaves[start]);
+            return index;
+        }
+
+        aabb centroids = aabb::empty;
+        for (size_t i = start; i < end; i++)
+        {
+            auto c = center(leaves[i].bounds);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+        int axis = centroids.longest_axis();
+        auto mid = start + (end - start) / 2;
+        std::nth_element(leaves.begin() + start, leaves.begin() + mid, leaves.begin() + end,
+                         [axis](const node &a, const node &b)
+                         { return center(a.bounds)[axis] < center(b.bounds)[axis]; });
+
+        nodes.emplace_back();
+        int left = build(leaves, start, mid);
+        int right = build(leaves, mid, end);
+
+        node &n = nodes[index];
+        const node &l = nodes[left], &r = nodes[right];
+        n.bounds = aabb(l.bounds, r.bounds);
+        n.power = l.power + r.power;
+        merge_cones(l, r, n.axis, n.spread);
+        n.left = left;
+        n.right = right;
+        return index;
+    }
+
+    // Upper bound on the light a subtree can deliver to point p with surface normal n: its power,
+    // falling off with distance, times the best emitter and receiver cosines any point in its bounds
+    // could achieve. Zero only when no emitter below can possibly reach p.
+    static float importance(const node &nd, const vec3 &p, const vec3 &n)
+    {
+        vec3 to_light = center(nd.bounds) - p;
+        float distance_squared = to_light.length_squared();
+        vec3 half_diagonal = 0.5f * vec3(nd.bounds.x.size(), nd.bounds.y.size(), nd.bounds.z.size());
+        float radius_squared = half_diagonal.length_squared();
+        float falloff = nd.power / std::max(distance_squared, radius_squared);
+        if (distance_squared <= radius_squared)
+            return falloff;
+
+        float distance = sqrt(distance_squared);
+        vec3 dir = to_light / distance;
+        float theta_u = asin(sqrt(radius_squared) / distance);
+
+        float cos_emit = 1;
+        if (nd.spread < PI)
+        {
+            float theta = acos(std::clamp(dot(-dir, nd.axis), -1.0f, 1.0f));
+            float theta_e = std::max(0.0f, theta - nd.spread - theta_u);
+            if (theta_e >= PI / 2)
+                return 0;
+            cos_emit = cos(theta_e);
+        }
+
+        float theta_i = acos(std::clamp(dot(n, dir), -1.0f, 1.0f));
+        float theta_r = std::max(0.0f, theta_i - theta_u);
+        if (theta_r >= PI / 2)
+            return 0;
+        return falloff * cos_emit * cos(theta_r);
+    }
+
+public:
+    void build(const hittable &world)
+    {
+        nodes.clear();
+        std::vector<const hittable *> lights;
+        world.collect_lights(lights);
+
+        std::vector<node> leaves;
+        for (const auto *light : lights)
+        {
+            auto info = light->emitter();
+            if (info.power <= 0)
+                continue;
+            node leaf;
+            leaf.bounds = info.bounds;
+            leaf.axis = unit(info.axis);
+            leaf.spread = info.spread;
+            leaf.power = info.power;
+            leaf.light = light;
+            leaves.push_back(leaf);
+        }
+
+        sorted_lights.clear();
+        for (const auto &leaf : leaves)
+            sorted_lights.push_back(leaf.light);
+        std::sort(sorted_lights.begin(), sorted_lights.end());
+
+        if (!leaves.empty())
+        {
+            nodes.reserve(2 * leaves.size() - 1);
+            build(leaves, 0, leaves.size());
+        }
+    }
+
+    bool empty() const { return nodes.empty(); }
+    size_t size() const { return sorted_lights.size(); }
+
+    // Whether light sampling covers this object, i.e. sample() can return it.
+    bool contains(const hittable *object) const
+    {
+        return std::binary_search(sorted_lights.begin(), sorted_lights.end(), object);
+    }
+
+    // Picks a light for shading point p with normal n, and the probability of having picked it.
+    // Returns nullptr when no light can reach p.
+    const hittable *sample(const vec3 &p, const vec3 &n, float &pmf) const
+    {
+        pmf = 1;
+        if (nodes.empty())
+            return nullptr;
+
+        int index = 0;
+        while (nodes[index].light == nullptr)
+        {
+            const node &nd = nodes[index];
+            float left = importance(nodes[nd.left], p, n);
+            float right = importance(nodes[nd.right], p, n);
+            if (left + right <= 0)
+                return nullptr;
+
+            float p_left = left / (left + right);
+            if (random_float() < p_left)
+            {
+                pmf *= p_left;
+                index = nd.left;
+            }
+            else
+            {
+                pmf *= 1 - p_left;
+                index = nd.right;
+            }
+        }
+        return nodes[index].light;
+    }
+};
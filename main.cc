@@ -1,21 +1,120 @@
 #include "rtw.h"
 
 #include "hittable.h"
+#include "bvh.h"
+#include "lazy_bvh.h"
+#include "compact_bvh.h"
+#include "chunked_scene.h"
+#include "trace.h"
 #include "material.h"
 #include "hittable_list.h"
 #include "sphere.h"
 #include "camera.h"
 #include "texture.h"
 #include "quad.h"
+#include "box.h"
 #include "constant_medium.h"
+#include "animation.h"
+#include "arena.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "render_server.h"
+#include "image_compare.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+// Command-line options applied to whichever scene gets rendered.
+struct render_settings
+{
+    bool progressive = false;
+    float time_budget = 0;
+    int band_height = 0;
+    std::string preview; // raw rgb24 frame stream after each progressive pass; "-" for stdout
+    std::string output;  // final PPM; stdout when empty
+    uint64_t seed = 0;   // when non-zero, reseeds the sampler after the scene is built
+    std::string environment; // lat-long .pfm radiance map lighting the scene instead of its background
+    int cache_resolution = 0; // radiance cache cells across the scene; 0 disables the cache
+    int caustic_photons = 0;  // photons traced for the caustic photon map; 0 disables it
+    bool bidirectional = false; // bidirectional path tracing instead of the path tracer
+    bool wavefront = false;     // batched breadth-first path tracing instead of one path at a time
+    bvh_build bvh = bvh_build::quality; // split strategy for scenes that build a BVH
+    bool lazy_bvh = false;              // build BVH subtrees the first time a ray enters them
+    bool compact_bvh = false;           // quantized BVH nodes, for large static scenes
+    bool unaccelerated = false;         // leave objects in plain lists, for writers that regroup them
+    int views = 1; // cameras spaced evenly around the scene's look-at point, each to its own image
+};
+render_settings settings;
+uint64_t last_render_rays = 0;
+
+// The acceleration structure the command line asks for, over every object in world.
+shared_ptr<hittable> accelerate(scene_arena &arena, const hittable_list &world)
+{
+    if (settings.unaccelerated)
+        return arena.make<hittable_list>(world);
+    if (settings.lazy_bvh)
+        return arena.make<lazy_bvh>(world, settings.bvh);
+    if (settings.compact_bvh)
+        return arena.make<compact_bvh>(world, settings.bvh);
+    return arena.make<bvh_node>(world, settings.bvh);
+}
+
+// Copies the render options in settings onto cam.
+void apply_settings(camera &cam)
+{
+    if (settings.seed)
+        seed_random(settings.seed);
+    cam.progressive = settings.progressive;
+    cam.time_budget = settings.time_budget;
+    cam.band_height = settings.band_height;
+    cam.cache_resolution = settings.cache_resolution;
+    cam.caustic_photons = settings.caustic_photons;
+    cam.bidirectional = settings.bidirectional;
+    cam.wavefront = settings.wavefront;
+    if (!settings.environment.empty())
+    {
+        float_image map;
+        if (map.load_pfm(settings.environment))
+            cam.environment = make_shared<environment_light>(std::move(map));
+        else
+            std::clog << "could not read environment map " << settings.environment << std::endl;
+    }
+}
+
+void render(camera &cam, const hittable &world)
+{
+    apply_settings(cam);
+    std::ofstream preview_file;
+    if (settings.preview == "-")
+        cam.preview = &std::cout;
+    else if (!settings.preview.empty())
+    {
+        preview_file.open(settings.preview, std::ios::binary);
+        cam.preview = &preview_file;
+    }
+
+    if (settings.output.empty())
+        cam.render(world);
+    else
+    {
+        std::ofstream out(settings.output);
+        cam.render(world, out);
+    }
+    last_render_rays = cam.rays_traced();
+}
 
-void book1_final_scene(int width, int sample_per_pixel)
+void book1_final_scene(scene &s)
 {
     // World
-    hittable_list world;
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
 
-    auto ground_material = make_shared<lambertian>(color(.5, .5, .5));
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, ground_material));
+    auto ground_material = arena.make<lambertian>(color(.5, .5, .5));
+    world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, ground_material));
 
     for (int a = -11; a < 11; a++)
     {
@@ -30,38 +129,38 @@ void book1_final_scene(int width, int sample_per_pixel)
                 {
                     // diffuse
                     auto albedo = random_vec3() * random_vec3();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena.make<lambertian>(albedo);
                 }
                 else if (choose_mat < 0.95)
                 {
                     // metal
                     auto albedo = random_vec3(0.5, 1);
                     auto fuzz = random_float(0, .5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
+                    sphere_material = arena.make<metal>(albedo, fuzz);
                 }
                 else
                 {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
+                    sphere_material = arena.make<dielectric>(1.5);
                 }
-                world.add(make_shared<sphere>(center, .2, sphere_material));
+                world.add(arena.make<sphere>(center, .2, sphere_material));
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
+    auto material1 = arena.make<dielectric>(1.5);
+    world.add(arena.make<sphere>(vec3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(.4, .2, .1));
-    world.add(make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+    auto material2 = arena.make<lambertian>(color(.4, .2, .1));
+    world.add(arena.make<sphere>(vec3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(.7, .6, .5), 0.0);
-    world.add(make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+    auto material3 = arena.make<metal>(color(.7, .6, .5), 0.0);
+    world.add(arena.make<sphere>(vec3(4, 1, 0), 1.0, material3));
 
-    camera cam;
+    world = hittable_list(accelerate(arena, world));
+
+    camera &cam = s.cam;
     cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0.70, 0.80, 1.00);
 
@@ -72,17 +171,16 @@ void book1_final_scene(int width, int sample_per_pixel)
 
     cam.defocus_angle = .6;
     cam.focus_dist = 10.0;
-
-    cam.render(world);
 }
 
-void book1_final_scene_motionblur(int width, int sample_per_pixel)
+void book1_final_scene_motionblur(scene &s)
 {
     // World
-    hittable_list world;
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
 
-    auto checker = make_shared<checkered_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    auto checker = arena.make<checkered_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(checker)));
 
     for (int a = -11; a < 11; a++)
     {
@@ -97,41 +195,41 @@ void book1_final_scene_motionblur(int width, int sample_per_pixel)
                 {
                     // diffuse
                     auto albedo = random_vec3() * random_vec3();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena.make<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_float(0, .5), 0);
-                    world.add(make_shared<sphere>(center, center2, .2, sphere_material));
+                    world.add(arena.make<sphere>(center, center2, .2, sphere_material));
                 }
                 else if (choose_mat < 0.95)
                 {
                     // metal
                     auto albedo = random_vec3(0.5, 1);
                     auto fuzz = random_float(0, .5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, .2, sphere_material));
+                    sphere_material = arena.make<metal>(albedo, fuzz);
+                    world.add(arena.make<sphere>(center, .2, sphere_material));
                 }
                 else
                 {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, .2, sphere_material));
+                    sphere_material = arena.make<dielectric>(1.5);
+                    world.add(arena.make<sphere>(center, .2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, material1));
+    auto material1 = arena.make<dielectric>(1.5);
+    world.add(arena.make<sphere>(vec3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(.4, .2, .1));
-    world.add(make_shared<sphere>(vec3(-4, 1, 0), 1.0, material2));
+    auto material2 = arena.make<lambertian>(color(.4, .2, .1));
+    world.add(arena.make<sphere>(vec3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(.7, .6, .5), 0.0);
-    world.add(make_shared<sphere>(vec3(4, 1, 0), 1.0, material3));
+    auto material3 = arena.make<metal>(color(.7, .6, .5), 0.0);
+    world.add(arena.make<sphere>(vec3(4, 1, 0), 1.0, material3));
 
-    camera cam;
+    world = hittable_list(accelerate(arena, world));
+
+    camera &cam = s.cam;
     cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0.70, 0.80, 1.00);
 
@@ -142,23 +240,20 @@ void book1_final_scene_motionblur(int width, int sample_per_pixel)
 
     cam.defocus_angle = .6;
     cam.focus_dist = 10.0;
-
-    cam.render(world);
 }
 
-void checkered_spheres(int width, int sample_per_pixel)
+void checkered_spheres(scene &s)
 {
-    hittable_list world;
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
 
-    auto checker = make_shared<checkered_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    auto checker = arena.make<checkered_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
 
-    world.add(make_shared<sphere>(vec3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(vec3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    world.add(arena.make<sphere>(vec3(0, -10, 0), 10, arena.make<lambertian>(checker)));
+    world.add(arena.make<sphere>(vec3(0, 10, 0), 10, arena.make<lambertian>(checker)));
 
-    camera cam;
+    camera &cam = s.cam;
     cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0.70, 0.80, 1.00);
 
@@ -169,30 +264,27 @@ void checkered_spheres(int width, int sample_per_pixel)
 
     cam.defocus_angle = .6;
     cam.focus_dist = 10.0;
-
-    cam.render(world);
 }
 
-void quads(int width, int sample_per_pixel)
+void quads(scene &s)
 {
-    hittable_list world;
-
-    auto left_red = make_shared<lambertian>(color(1.0, .2, .2));
-    auto back_green = make_shared<lambertian>(color(0.2, 1.0, 0.2));
-    auto right_blue = make_shared<lambertian>(color(.2, .2, 1.0));
-    auto upper_orange = make_shared<lambertian>(color(1.0, .5, .0));
-    auto lower_teal = make_shared<lambertian>(color(.2, .8, .8));
-
-    world.add(make_shared<quad>(vec3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
-    world.add(make_shared<quad>(vec3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
-    world.add(make_shared<quad>(vec3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
-    world.add(make_shared<quad>(vec3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
-    world.add(make_shared<quad>(vec3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
-
-    camera cam;
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto left_red = arena.make<lambertian>(color(1.0, .2, .2));
+    auto back_green = arena.make<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue = arena.make<lambertian>(color(.2, .2, 1.0));
+    auto upper_orange = arena.make<lambertian>(color(1.0, .5, .0));
+    auto lower_teal = arena.make<lambertian>(color(.2, .8, .8));
+
+    world.add(arena.make<quad>(vec3(-3, -2, 5), vec3(0, 0, -4), vec3(0, 4, 0), left_red));
+    world.add(arena.make<quad>(vec3(-2, -2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(arena.make<quad>(vec3(3, -2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(arena.make<quad>(vec3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+    world.add(arena.make<quad>(vec3(-2, -3, 5), vec3(4, 0, 0), vec3(0, 0, -4), lower_teal));
+
+    camera &cam = s.cam;
     cam.aspect_ratio = 1.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0.70, 0.80, 1.00);
 
@@ -203,28 +295,25 @@ void quads(int width, int sample_per_pixel)
 
     cam.defocus_angle = .0;
     // cam.focus_dist = 10.0;
-
-    cam.render(world);
 }
 
-void simple_light(int width, int sample_per_pixel)
+void simple_light(scene &s)
 {
-    hittable_list world;
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
 
-    auto text1 = make_shared<solid_color>(color(1., .5, .2));
-    auto text2 = make_shared<solid_color>(color(.2, .5, 1.));
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(text1)));
-    world.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(text2)));
+    auto text1 = arena.make<solid_color>(color(1., .5, .2));
+    auto text2 = arena.make<solid_color>(color(.2, .5, 1.));
+    world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(text1)));
+    world.add(arena.make<sphere>(vec3(0, 2, 0), 2, arena.make<lambertian>(text2)));
 
-    auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-    world.add(make_shared<sphere>(vec3(0, 7, 0), 2, difflight));
-    world.add(make_shared<quad>(vec3(3, 1, -2), vec3(2, 0, 0), vec3(0, 2, 0), difflight));
+    auto difflight = arena.make<diffuse_light>(color(4, 4, 4));
+    world.add(arena.make<sphere>(vec3(0, 7, 0), 2, difflight));
+    world.add(arena.make<quad>(vec3(3, 1, -2), vec3(2, 0, 0), vec3(0, 2, 0), difflight));
 
-    camera cam;
+    camera &cam = s.cam;
 
     cam.aspect_ratio = 16.0 / 9.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0, 0, 0);
 
@@ -234,50 +323,81 @@ void simple_light(int width, int sample_per_pixel)
     cam.vup = vec3(0, 1, 0);
 
     cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
-void cornell_box(int width, int sample_per_pixel)
+void cornell_box(scene &s)
 {
-    hittable_list world;
-
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(12, 12, 12));
-    auto glass = make_shared<dielectric>(1.5);
-    auto mirror = make_shared<metal>(vec3(1, 1, 1), 0);
-
-    world.add(make_shared<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-    world.add(make_shared<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-    world.add(make_shared<quad>(vec3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
-    world.add(make_shared<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(vec3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
-    world.add(make_shared<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
-
-    shared_ptr<hittable> box1 = box(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(12, 12, 12));
+    auto glass = arena.make<dielectric>(1.5);
+    auto mirror = arena.make<metal>(vec3(1, 1, 1), 0);
+
+    world.add(arena.make<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    world.add(arena.make<quad>(vec3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(arena.make<quad>(vec3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    world.add(arena.make<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+    auto box1 = arena.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white, vec3(0, 1, 0), 15, vec3(265, 0, 295));
     world.add(box1);
 
-    shared_ptr<hittable> box2 = box(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    auto box2 = arena.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white, vec3(0, 1, 0), -18, vec3(130, 0, 65));
     world.add(box2);
 
-    shared_ptr<hittable> sphere1 = make_shared<sphere>(vec3(0, 0, 0), 45, mirror);
-    sphere1 = make_shared<translate>(sphere1, vec3(180, 210, 140));
-    shared_ptr<hittable> sphere2 = make_shared<sphere>(vec3(0, 0, 0), 75, glass);
-    sphere2 = make_shared<translate>(sphere2, vec3(420, 75, 100));
+    shared_ptr<hittable> sphere1 = arena.make<sphere>(vec3(0, 0, 0), 45, mirror);
+    sphere1 = arena.make<translate>(sphere1, vec3(180, 210, 140));
+    shared_ptr<hittable> sphere2 = arena.make<sphere>(vec3(0, 0, 0), 75, glass);
+    sphere2 = arena.make<translate>(sphere2, vec3(420, 75, 100));
     world.add(sphere1);
     world.add(sphere2);
 
-    camera cam;
+    camera &cam = s.cam;
+
+    cam.aspect_ratio = 1.0;
+    cam.max_depth = 50;
+    cam.background = color(0, 0, 0);
+
+    cam.vfov = 40;
+    cam.lookfrom = vec3(278, 278, -800);
+    cam.lookat = vec3(278, 278, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+}
+
+void cornell_smoke(scene &s)
+{
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(7, 7, 7));
+
+    world.add(arena.make<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    world.add(arena.make<quad>(vec3(113, 554, 127), vec3(330, 0, 0), vec3(0, 0, 305), light));
+    world.add(arena.make<quad>(vec3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(arena.make<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+
+    auto box1 = arena.make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white, vec3(0, 1, 0), 15, vec3(265, 0, 295));
+
+    auto box2 = arena.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white, vec3(0, 1, 0), -18, vec3(130, 0, 65));
+
+    world.add(arena.make<constant_medium>(box1, 0.01, color(0, 0, 0)));
+    world.add(arena.make<constant_medium>(box2, 0.01, color(1, 1, 1)));
+
+    camera &cam = s.cam;
 
     cam.aspect_ratio = 1.0;
-    cam.image_width = width;
-    cam.samples_per_pixel = sample_per_pixel;
     cam.max_depth = 50;
     cam.background = color(0, 0, 0);
 
@@ -287,36 +407,129 @@ void cornell_box(int width, int sample_per_pixel)
     cam.vup = vec3(0, 1, 0);
 
     cam.defocus_angle = 0;
+}
+
+void many_lights(scene &s)
+{
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto ground = arena.make<lambertian>(color(.5, .5, .5));
+    world.add(arena.make<quad>(vec3(-20, 0, -20), vec3(40, 0, 0), vec3(0, 0, 40), ground));
+
+    // A 24 x 24 grid of small coloured lamps with a few diffuse spheres standing between them.
+    for (int a = 0; a < 24; a++)
+    {
+        for (int b = 0; b < 24; b++)
+        {
+            vec3 center(-11.5 + a + 0.5 * random_float(), 0.15, -11.5 + b + 0.5 * random_float());
+            auto emit = 4 * random_vec3(0.2, 1);
+            world.add(arena.make<sphere>(center, 0.15, arena.make<diffuse_light>(emit)));
+        }
+    }
+    for (int i = 0; i < 12; i++)
+    {
+        vec3 center(random_float(-8, 8), 0.8, random_float(-8, 8));
+        world.add(arena.make<sphere>(center, 0.8, arena.make<lambertian>(random_vec3(0.3, 0.9))));
+    }
+
+    world = hittable_list(accelerate(arena, world));
 
-    cam.render(world);
+    camera &cam = s.cam;
+
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 20;
+    cam.background = color(0, 0, 0);
+
+    cam.vfov = 35;
+    cam.lookfrom = vec3(0, 9, 22);
+    cam.lookat = vec3(0, 0, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
 }
 
-void cornell_smoke(int width, int sample_per_pixel)
+void sunlit_spheres(scene &s)
 {
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto checker = arena.make<checkered_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(checker)));
+    world.add(arena.make<sphere>(vec3(-2.2, 1, 0), 1.0, arena.make<lambertian>(color(.8, .3, .2))));
+    world.add(arena.make<sphere>(vec3(0, 1, 0), 1.0, arena.make<dielectric>(1.5)));
+    world.add(arena.make<sphere>(vec3(2.2, 1, 0), 1.0, arena.make<metal>(color(.8, .8, .7), 0.1)));
+
+    camera &cam = s.cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+    // A low sun a few hundred times brighter than the sky, which a constant background cannot give.
+    cam.environment = make_shared<environment_light>(
+        sky_image(512, 256, vec3(1, 0.8, -0.6), 1.5, color(1500, 1350, 1100), color(.1, .2, .45), color(.35, .4, .5)));
+
+    cam.vfov = 30;
+    cam.lookfrom = vec3(0, 2.5, 10);
+    cam.lookat = vec3(0, 0.8, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+}
+
+void perlin_spheres(scene &s)
+{
+    scene_arena &arena = s.arena;
+    hittable_list &world = s.world;
+
+    auto clouds = arena.make<noise_texture>(2, noise_pattern::turbulence, color(.25, .3, .35), color(.9, .9, .9));
+    auto marble = arena.make<noise_texture>(4, noise_pattern::marble, color(.1, .1, .12), color(.95, .95, .9));
+    auto wood = arena.make<noise_texture>(6, noise_pattern::wood, color(.35, .18, .07), color(.7, .45, .25));
+    // The marble sphere is the only large textured area in view, so its noise is worth baking.
+    marble->bake(aabb(vec3(-2, 0, -2), vec3(2, 4, 2)), 96);
+
+    world.add(arena.make<sphere>(vec3(0, -1000, 0), 1000, arena.make<lambertian>(clouds)));
+    world.add(arena.make<sphere>(vec3(0, 2, 0), 2, arena.make<lambertian>(marble)));
+    world.add(arena.make<sphere>(vec3(1.5, 0.8, 3), 0.8, arena.make<lambertian>(wood)));
+
+    camera &cam = s.cam;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.max_depth = 50;
+    cam.background = color(0.70, 0.80, 1.00);
+
+    cam.vfov = 20;
+    cam.lookfrom = vec3(13, 2, 3);
+    cam.lookat = vec3(0, 1, 0);
+    cam.vup = vec3(0, 1, 0);
+
+    cam.defocus_angle = 0;
+}
+
+void cornell_box_animation(int width, int sample_per_pixel, int frames)
+{
+    scene_arena arena;
     hittable_list world;
 
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(12, 12, 12));
+    auto mirror = arena.make<metal>(vec3(1, 1, 1), 0);
 
-    world.add(make_shared<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
-    world.add(make_shared<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
-    world.add(make_shared<quad>(vec3(113, 554, 127), vec3(330, 0, 0), vec3(0, 0, 305), light));
-    world.add(make_shared<quad>(vec3(0, 555, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
-    world.add(make_shared<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
+    world.add(arena.make<quad>(vec3(555, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), green));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(0, 555, 0), vec3(0, 0, 555), red));
+    world.add(arena.make<quad>(vec3(343, 554, 332), vec3(-130, 0, 0), vec3(0, 0, -105), light));
+    world.add(arena.make<quad>(vec3(0, 0, 0), vec3(555, 0, 0), vec3(0, 0, 555), white));
+    world.add(arena.make<quad>(vec3(555, 555, 555), vec3(-555, 0, 0), vec3(0, 0, -555), white));
+    world.add(arena.make<quad>(vec3(0, 0, 555), vec3(555, 0, 0), vec3(0, 555, 0), white));
 
-    shared_ptr<hittable> box1 = box(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    // Turntable: the tall box spins in place while the mirror sphere bobs above the short box.
+    auto spin = arena.make<rotate_y>(arena.make<box>(vec3(-82.5, 0, -82.5), vec3(82.5, 330, 82.5), white), 0);
+    world.add(arena.make<translate>(spin, vec3(347.5, 0, 377.5)));
 
-    shared_ptr<hittable> box2 = box(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    auto box2 = arena.make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white, vec3(0, 1, 0), -18, vec3(130, 0, 65));
+    world.add(box2);
 
-    world.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
-    world.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
+    auto bob = arena.make<translate>(arena.make<sphere>(vec3(0, 0, 0), 45, mirror), vec3(180, 210, 140));
+    world.add(bob);
 
     camera cam;
 
@@ -332,34 +545,554 @@ void cornell_smoke(int width, int sample_per_pixel)
     cam.vup = vec3(0, 1, 0);
 
     cam.defocus_angle = 0;
+    apply_settings(cam);
+    if (settings.views > 1)
+        std::clog << "--views is not supported for animated scenes; rendering one view" << std::endl;
+
+    animation anim;
+    anim.frame_count = frames;
+    // --output names the frames: "-" streams them, anything else gets _NNNN before .ppm.
+    if (settings.output == "-")
+        anim.output = "-";
+    else if (!settings.output.empty())
+    {
+        std::string base = settings.output;
+        if (base.size() > 4 && base.compare(base.size() - 4, 4, ".ppm") == 0)
+            base.resize(base.size() - 4);
+        anim.output.clear();
+        for (char c : base)
+            anim.output += c == '%' ? std::string("%%") : std::string(1, c);
+        anim.output += "_%04d.ppm";
+    }
+    anim.rotate_key(spin, 0, 0);
+    anim.rotate_key(spin, frames, 360);
+    anim.translate_key(bob, 0, vec3(180, 210, 140));
+    anim.translate_key(bob, frames / 2, vec3(180, 320, 140));
+    anim.translate_key(bob, frames, vec3(180, 210, 140));
+    anim.camera_key(0, vec3(278, 278, -800), vec3(278, 278, 0), 40);
+    anim.camera_key(frames, vec3(278, 278, -600), vec3(278, 278, 0), 40);
+
+    anim.render(cam, world);
+}
+
+struct scene_entry
+{
+    const char *name;
+    void (*build)(scene &s); // still scenes
+    int width;
+    int sample_per_pixel;
+    void (*animate)(int width, int sample_per_pixel) = nullptr; // animated scenes, which render themselves
+};
+
+const scene_entry scenes[] = {
+    {"book1_final_scene", book1_final_scene, 400, 100},
+    {"book1_final_scene_motionblur", book1_final_scene_motionblur, 400, 100},
+    {"checkered_spheres", checkered_spheres, 400, 100},
+    {"quads", quads, 400, 100},
+    {"simple_light", simple_light, 400, 100},
+    {"cornell_box", cornell_box, 400, 5000},
+    {"cornell_smoke", cornell_smoke, 400, 1000},
+    {"cornell_box_animation", nullptr, 200, 50, [](int width, int spp)
+     { cornell_box_animation(width, spp, 48); }},
+    {"many_lights", many_lights, 400, 100},
+    {"sunlit_spheres", sunlit_spheres, 400, 100},
+    {"perlin_spheres", perlin_spheres, 400, 100},
+};
+const int scene_count = sizeof(scenes) / sizeof(scenes[0]);
+
+// cam swung about its look-at point around vup by degrees.
+camera orbit(const camera &cam, float degrees)
+{
+    camera view = cam;
+    vec3 axis = unit(cam.vup);
+    vec3 offset = cam.lookfrom - cam.lookat;
+    float c = std::cos(to_radians(degrees)), s = std::sin(to_radians(degrees));
+    view.lookfrom = cam.lookat + c * offset + s * cross(axis, offset) + (1 - c) * dot(axis, offset) * axis;
+    return view;
+}
 
-    cam.render(world);
+// Renders settings.views orbits of the scene's camera in one batch over a single build of the
+// world. View k goes to <output>_k.ppm, with the output's .ppm extension dropped, or view_k.ppm.
+void render_views(scene &s)
+{
+    apply_settings(s.cam);
+    std::string base = settings.output.empty() ? "view" : settings.output;
+    if (base.size() > 4 && base.compare(base.size() - 4, 4, ".ppm") == 0)
+        base.resize(base.size() - 4);
+
+    std::vector<camera> views;
+    std::vector<std::ofstream> files(settings.views);
+    std::vector<std::ostream *> outs;
+    for (int k = 0; k < settings.views; k++)
+    {
+        views.push_back(orbit(s.cam, 360.0f * k / settings.views));
+        files[k].open(base + "_" + std::to_string(k) + ".ppm");
+        outs.push_back(&files[k]);
+    }
+    camera::render_views(s.world, views, outs);
+    last_render_rays = 0;
+    for (const auto &view : views)
+        last_render_rays += view.rays_traced();
+}
+
+void render_scene(const scene_entry &entry, int width, int sample_per_pixel)
+{
+    if (entry.animate)
+    {
+        entry.animate(width, sample_per_pixel);
+        return;
+    }
+    scene s;
+    {
+        trace_span span("scene build", "build");
+        entry.build(s);
+    }
+    s.cam.image_width = width;
+    s.cam.samples_per_pixel = sample_per_pixel;
+    if (settings.views > 1)
+        render_views(s);
+    else
+        render(s.cam, s.world);
 }
 
-int main()
+// Where a regression case's scene is traced from.
+enum class regression_source
 {
-    switch (6)
+    memory,   // built in memory, as for a normal render
+    snapshot, // saved with write_snapshot() and traced from the mapped file
+    chunks    // saved with write_chunks() and traced through chunked_scene with a small budget
+};
+
+// Golden-image regression over the still scenes. --bless renders each case small at a fixed seed
+// into dir as the reference, renders it again at a second sampling seed to measure the Monte Carlo
+// noise floor, and records render time and rays/s. --check re-renders at the reference seed and fails
+// if the image differs from the reference by clearly more than that noise floor, or if render
+// time or throughput regressed beyond the tolerances below. Cases with a variant render with the
+// options their configure function sets; scenes traced from disk with default options must also
+// match the in-memory reference of the same scene exactly.
+int regression(const std::string &dir, bool bless)
+{
+    struct regression_case
+    {
+        int scene;
+        int width;
+        int sample_per_pixel;
+        const char *variant = nullptr; // mode under test, appended to the file names
+        void (*configure)(render_settings &options, const std::string &dir) = nullptr;
+        regression_source source = regression_source::memory;
+    };
+    const regression_case cases[] = {
+        {1, 96, 16},
+        {2, 96, 16},
+        {3, 96, 16},
+        {4, 96, 16},
+        {5, 96, 64},
+        {6, 64, 64},
+        {7, 64, 64},
+        {9, 96, 16},
+        {10, 96, 16},
+        {11, 96, 16},
+        {6, 48, 16, "bdpt", [](render_settings &o, const std::string &) { o.bidirectional = true; }},
+        {1, 96, 16, "wavefront", [](render_settings &o, const std::string &) { o.wavefront = true; }},
+        {6, 64, 64, "cache", [](render_settings &o, const std::string &) { o.cache_resolution = 32; }},
+        {6, 64, 64, "caustics", [](render_settings &o, const std::string &) { o.caustic_photons = 20000; }},
+        {3, 96, 16, "env", [](render_settings &o, const std::string &dir) { o.environment = dir + "/sky.pfm"; }},
+        {1, 96, 16, "lazy_bvh", [](render_settings &o, const std::string &) { o.lazy_bvh = true; }},
+        {1, 96, 16, "compact_bvh", [](render_settings &o, const std::string &) { o.compact_bvh = true; }},
+        {6, 64, 32, "views", [](render_settings &o, const std::string &) { o.views = 2; }},
+        {1, 96, 16, "snapshot", nullptr, regression_source::snapshot},
+        {1, 96, 16, "chunks", nullptr, regression_source::chunks},
+        {1, 96, 16, "chunks_wavefront", [](render_settings &o, const std::string &) { o.wavefront = true; }, regression_source::chunks},
+    };
+    const float noise_tolerance = 1.5f;
+    const float time_tolerance = 1.25f;
+    // Renders shorter than this are too jittery to judge; it is also added as slack to time budgets.
+    const double timing_floor = 0.1;
+    const int timing_runs = 3;
+    // The chunk case keeps a few of its chunks resident, so tracing it loads and evicts.
+    const size_t chunk_objects = 32;
+    const size_t chunk_budget = 32 << 10;
+
+    // Light for the env case, written here so the regression needs no files but its own.
+    if (!sky_image(64, 32, vec3(1, 0.8, -0.6), 4, color(400, 360, 300), color(.1, .2, .45), color(.35, .4, .5))
+             .save_pfm(dir + "/sky.pfm"))
     {
-    case 1:
-        book1_final_scene(400, 100);
-        break;
-    case 2:
-        book1_final_scene_motionblur(400, 100);
-        break;
-    case 3:
-        checkered_spheres(400, 100);
-        break;
-    case 4:
-        quads(400, 100);
-        break;
-    case 5:
-        simple_light(400, 100);
-        break;
-    case 6:
-        cornell_box(400, 5000);
-        break;
-    case 7:
-        cornell_smoke(400, 1000);
-        break;
+        std::clog << "could not write " << dir << "/sky.pfm" << std::endl;
+        return 1;
     }
-}
\ No newline at end of file
+
+    // Saves the case's scene, built from seed 1, where render_case() reads it from.
+    auto store = [&](const regression_case &c, const std::string &path, std::string &error)
+    {
+        const auto &entry = scenes[c.scene - 1];
+        render_settings saved = settings;
+        settings.unaccelerated = c.source == regression_source::chunks;
+        scene s;
+        seed_random(1);
+        entry.build(s);
+        settings = saved;
+        s.cam.image_width = c.width;
+        s.cam.samples_per_pixel = c.sample_per_pixel;
+        return c.source == regression_source::snapshot ? write_snapshot(s, path, error)
+                                                       : write_chunks(s, path, chunk_objects, error);
+    };
+
+    // Renders the case once into settings.output, from wherever its scene lives.
+    auto render_case = [&](const regression_case &c, const std::string &stored, std::string &error)
+    {
+        const auto &entry = scenes[c.scene - 1];
+        camera cam;
+        if (c.source == regression_source::snapshot)
+        {
+            mapped_scene world;
+            if (!world.open(stored, error))
+                return false;
+            world.apply(cam);
+            render(cam, world);
+        }
+        else if (c.source == regression_source::chunks)
+        {
+            chunked_scene world;
+            if (!world.open(stored, chunk_budget, error))
+                return false;
+            world.apply(cam);
+            render(cam, world);
+        }
+        else
+            render_scene(entry, c.width, c.sample_per_pixel);
+        return true;
+    };
+
+    // The scene is always built from seed 1 so only the sampling differs between seeds. Timing
+    // keeps the fastest of a few runs to ride out scheduler noise.
+    auto timed_render = [&](const regression_case &c, uint64_t seed, const std::string &path, const std::string &stored,
+                            double &rays_per_second, std::string &error)
+    {
+        render_settings saved = settings;
+        if (c.configure)
+            c.configure(settings, dir);
+        settings.output = path;
+        settings.seed = seed;
+        double best = infinity;
+        std::clog.setstate(std::ios::failbit);
+        for (int run = 0; run < timing_runs && error.empty(); run++)
+        {
+            seed_random(1);
+            auto start = std::chrono::steady_clock::now();
+            if (render_case(c, stored, error))
+                best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::clog.clear();
+        // Multi-view renders write one image per view; the first is the one checked.
+        if (settings.views > 1)
+        {
+            std::string stem = path.substr(0, path.size() - 4);
+            std::rename((stem + "_0.ppm").c_str(), path.c_str());
+            for (int k = 1; k < settings.views; k++)
+                std::remove((stem + "_" + std::to_string(k) + ".ppm").c_str());
+        }
+        settings = saved;
+        rays_per_second = last_render_rays / best;
+        return best;
+    };
+
+    int failures = 0;
+    for (const auto &c : cases)
+    {
+        const auto &entry = scenes[c.scene - 1];
+        std::string name = std::string(entry.name) + (c.variant ? std::string("_") + c.variant : "");
+        std::string reference_path = dir + "/" + name + ".ppm";
+        std::string stats_path = dir + "/" + name + ".txt";
+        std::string output_path = dir + "/" + name + (bless ? ".seed2.ppm" : ".out.ppm");
+        std::string stored = dir + "/" + name + (c.source == regression_source::snapshot ? ".snap" : ".chunks");
+        image8 reference, output;
+        double rays_per_second;
+        std::string error;
+
+        if (c.source != regression_source::memory && !store(c, stored, error))
+        {
+            std::clog << name << ": " << error << std::endl;
+            failures++;
+            continue;
+        }
+
+        if (bless)
+        {
+            double seconds = timed_render(c, 1, reference_path, stored, rays_per_second, error);
+            double unused;
+            if (error.empty())
+                timed_render(c, 2, output_path, stored, unused, error);
+            if (!error.empty())
+            {
+                std::clog << name << ": " << error << std::endl;
+                return 1;
+            }
+            if (!reference.load_ppm(reference_path) || !output.load_ppm(output_path))
+            {
+                std::clog << name << ": could not write references to " << dir << std::endl;
+                return 1;
+            }
+            std::ofstream(stats_path) << seconds << ' ' << rays_per_second << ' '
+                                      << image_rmse(reference, output) << ' '
+                                      << image_perceptual_error(reference, output) << ' '
+                                      << image_mean_shift(reference, output) << '\n';
+            std::remove(output_path.c_str());
+            std::clog << name << ": blessed (" << seconds << " s)" << std::endl;
+            continue;
+        }
+
+        double ref_seconds, ref_rays_per_second;
+        float noise_rmse, noise_perceptual, noise_mean;
+        if (!(std::ifstream(stats_path) >> ref_seconds >> ref_rays_per_second >> noise_rmse >> noise_perceptual >> noise_mean) ||
+            !reference.load_ppm(reference_path))
+        {
+            std::clog << name << ": no reference in " << dir << " (run with --bless first)" << std::endl;
+            failures++;
+            continue;
+        }
+
+        double seconds = timed_render(c, 1, output_path, stored, rays_per_second, error);
+        if (!error.empty())
+        {
+            std::clog << name << ": " << error << std::endl;
+            failures++;
+            continue;
+        }
+        output.load_ppm(output_path);
+        float rmse = image_rmse(reference, output);
+        float perceptual = image_perceptual_error(reference, output);
+        float mean_shift = image_mean_shift(reference, output);
+
+        bool image_ok = output.width == reference.width && output.height == reference.height &&
+                        rmse <= noise_tolerance * noise_rmse + 1e-3f &&
+                        perceptual <= noise_tolerance * noise_perceptual + 1e-3f &&
+                        mean_shift <= noise_tolerance * noise_mean + 1e-3f;
+        // A scene read back from disk traces the same geometry, so it must render bit-identically.
+        bool exact_ok = true;
+        if (c.source != regression_source::memory && !c.configure)
+        {
+            image8 in_memory;
+            exact_ok = in_memory.load_ppm(dir + "/" + entry.name + ".ppm") && in_memory.width == output.width &&
+                       in_memory.height == output.height && in_memory.rgb == output.rgb;
+        }
+        // Throughput gets the same slack as time: the reference's rays over its tolerated time.
+        double ref_rays = ref_rays_per_second * ref_seconds;
+        bool time_ok = seconds <= time_tolerance * ref_seconds + timing_floor &&
+                       rays_per_second >= ref_rays / (time_tolerance * ref_seconds + timing_floor);
+
+        std::clog << name << ": rmse " << rmse << " (noise " << noise_rmse << "), perceptual "
+                  << perceptual << " (noise " << noise_perceptual << "), mean shift " << mean_shift << " (noise "
+                  << noise_mean << "), " << seconds << " s (ref "
+                  << ref_seconds << "), " << rays_per_second / 1e6 << " Mrays/s (ref "
+                  << ref_rays_per_second / 1e6 << ")" << (image_ok ? "" : " IMAGE MISMATCH")
+                  << (exact_ok ? "" : " DIFFERS FROM IN-MEMORY RENDER") << (time_ok ? "" : " TOO SLOW") << std::endl;
+        failures += !image_ok || !exact_ok || !time_ok;
+        if (image_ok && exact_ok)
+            std::remove(output_path.c_str());
+    }
+    std::clog << (failures ? "FAILED: " : "passed: ") << failures << " failing case(s)" << std::endl;
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int first_option = argc > 1 && isdigit(argv[1][0]) ? 2 : 1;
+    int scene_number = first_option == 2 ? atoi(argv[1]) : 6;
+    std::string regression_dir;
+    std::string server_socket;
+    std::string save_snapshot, load_snapshot;
+    std::string save_chunks, load_chunks;
+    size_t chunk_objects = 65536;
+    double chunk_budget_mb = 1024; // fractions allowed, to run with less than one chunk resident
+    int resident_scenes = 4;
+    std::string trace_path;
+    bool bless = false;
+    for (int i = first_option; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if ((!strcmp(argv[i], "--check") || !strcmp(argv[i], "--bless")) && has_value)
+        {
+            bless = !strcmp(argv[i], "--bless");
+            regression_dir = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--progressive"))
+            settings.progressive = true;
+        else if (!strcmp(argv[i], "--budget") && has_value)
+        {
+            settings.progressive = true;
+            settings.time_budget = atof(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--band") && has_value)
+            settings.band_height = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--preview") && has_value)
+            settings.preview = argv[++i];
+        else if (!strcmp(argv[i], "--output") && has_value)
+            settings.output = argv[++i];
+        else if (!strcmp(argv[i], "--env") && has_value)
+            settings.environment = argv[++i];
+        else if (!strcmp(argv[i], "--cache") && has_value)
+            settings.cache_resolution = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--caustics") && has_value)
+            settings.caustic_photons = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--bdpt"))
+            settings.bidirectional = true;
+        else if (!strcmp(argv[i], "--wavefront"))
+            settings.wavefront = true;
+        else if (!strcmp(argv[i], "--fast-bvh"))
+            settings.bvh = bvh_build::fast;
+        else if (!strcmp(argv[i], "--lazy-bvh"))
+            settings.lazy_bvh = true;
+        else if (!strcmp(argv[i], "--compact-bvh"))
+            settings.compact_bvh = true;
+        else if (!strcmp(argv[i], "--save-snapshot") && has_value)
+            save_snapshot = argv[++i];
+        else if (!strcmp(argv[i], "--snapshot") && has_value)
+            load_snapshot = argv[++i];
+        else if (!strcmp(argv[i], "--save-chunks") && has_value)
+            save_chunks = argv[++i];
+        else if (!strcmp(argv[i], "--chunk-objects") && has_value)
+            chunk_objects = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--chunks") && has_value)
+            load_chunks = argv[++i];
+        else if (!strcmp(argv[i], "--chunk-budget") && has_value)
+            chunk_budget_mb = std::max(0.0, atof(argv[++i]));
+        else if (!strcmp(argv[i], "--serve") && has_value)
+            server_socket = argv[++i];
+        else if (!strcmp(argv[i], "--resident") && has_value)
+            resident_scenes = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--views") && has_value)
+            settings.views = std::max(1, atoi(argv[++i]));
+        else if (!strcmp(argv[i], "--trace") && has_value)
+            trace_path = argv[++i];
+        else
+        {
+            std::clog << "usage: " << argv[0] << " [scene] [--progressive] [--budget seconds] "
+                      << "[--band rows] [--preview file|-] [--output file] [--env map.pfm] [--cache cells] [--caustics photons] [--bdpt] [--wavefront] [--fast-bvh] [--lazy-bvh] [--compact-bvh] [--check|--bless dir] "
+                      << "[--save-snapshot file] [--snapshot file] "
+                      << "[--save-chunks dir [--chunk-objects N]] [--chunks dir [--chunk-budget MB]] [--serve socket [--resident scenes]] [--views N] [--trace file.json]" << std::endl;
+            return 1;
+        }
+    }
+    // Written on the way out of main, however it returns.
+    struct trace_output
+    {
+        std::string path;
+        ~trace_output()
+        {
+            if (!path.empty() && !tracer::global().write(path))
+                std::clog << "could not write trace " << path << std::endl;
+        }
+    } trace_file{trace_path};
+    if (!trace_path.empty())
+    {
+        tracer::name_thread("main");
+        tracer::global().start();
+    }
+
+    if (settings.preview == "-" && settings.output.empty())
+    {
+        std::clog << "--preview - streams to stdout; pass --output for the final image" << std::endl;
+        return 1;
+    }
+
+    if (!regression_dir.empty())
+        return regression(regression_dir, bless);
+    if (!server_socket.empty())
+    {
+        render_server server([](const std::string &name, scene &s)
+                             {
+            for (const auto &entry : scenes)
+                if (entry.build && name == entry.name)
+                {
+                    entry.build(s);
+                    return true;
+                }
+            return false; });
+        server.cache_capacity = std::max(1, resident_scenes);
+        if (!server.serve(server_socket))
+        {
+            std::clog << "could not listen on " << server_socket << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (!load_snapshot.empty())
+    {
+        mapped_scene world;
+        std::string error;
+        if (!world.open(load_snapshot, error))
+        {
+            std::clog << error << std::endl;
+            return 1;
+        }
+        camera cam;
+        world.apply(cam);
+        render(cam, world);
+        return 0;
+    }
+    if (!load_chunks.empty())
+    {
+        chunked_scene world;
+        std::string error;
+        if (!world.open(load_chunks, size_t(chunk_budget_mb * (1 << 20)), error))
+        {
+            std::clog << error << std::endl;
+            return 1;
+        }
+        camera cam;
+        world.apply(cam);
+        render(cam, world);
+        std::clog << world.chunk_count() << " chunks, " << world.loads() << " loads, " << world.evictions()
+                  << " evictions, " << world.requests() << " background requests" << std::endl;
+        return 0;
+    }
+    if (scene_number < 1 || scene_number > scene_count)
+    {
+        std::clog << "scene must be between 1 and " << scene_count << std::endl;
+        return 1;
+    }
+
+    const auto &entry = scenes[scene_number - 1];
+    if (!save_chunks.empty())
+    {
+        scene s;
+        std::string error;
+        settings.unaccelerated = true;
+        if (!entry.build)
+            error = "animated scenes cannot be saved in chunks";
+        else
+        {
+            entry.build(s);
+            s.cam.image_width = entry.width;
+            s.cam.samples_per_pixel = entry.sample_per_pixel;
+            write_chunks(s, save_chunks, chunk_objects, error);
+        }
+        if (!error.empty())
+        {
+            std::clog << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (!save_snapshot.empty())
+    {
+        scene s;
+        std::string error;
+        if (!entry.build)
+            error = "animated scenes cannot be saved in a snapshot";
+        else
+        {
+            entry.build(s);
+            s.cam.image_width = entry.width;
+            s.cam.samples_per_pixel = entry.sample_per_pixel;
+            write_snapshot(s, save_snapshot, error);
+        }
+        if (!error.empty())
+        {
+            std::clog << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    render_scene(entry, entry.width, entry.sample_per_pixel);
+}
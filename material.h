@@ -1,9 +1,12 @@
 #pragma once
 
 #include "rtw.h"
+#include "arena.h"
 #include "hittable.h"
 #include "texture.h"
 
+#include <algorithm>
+
 class material
 {
 public:
@@ -16,6 +19,23 @@ public:
     {
         return color(0, 0, 0);
     }
+    // Ideal diffuse scatterers: the attenuation from scatter() is the albedo of a cosine-weighted
+    // Lambertian lobe, so direct lighting can be evaluated as attenuation / pi * cos.
+    virtual bool is_diffuse() const { return false; }
+    // Whether emitted() can be non-zero.
+    virtual bool is_emissive() const { return false; }
+
+    // For integrators that connect path vertices explicitly. Materials whose scatter() draws from a
+    // continuous distribution report is_specular() false and describe that distribution: eval() is
+    // the BSDF (or phase function) for directions wi and wo, both pointing away from the hit, and
+    // pdf() the density with which scatter() picks wo. Specular materials are only ever sampled.
+    virtual bool is_specular() const { return true; }
+    virtual color eval(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const { return color(0, 0, 0); }
+    virtual float pdf(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const { return 0; }
+    // Scattering inside a participating medium: such hits have no surface and no cosine terms.
+    virtual bool is_volume() const { return false; }
+    // Fills in this material's snapshot record; false if snapshots cannot hold it.
+    virtual bool save(snapshot_writer &out, snapshot_material &record) const { return false; }
 };
 
 class lambertian : public material
@@ -25,6 +45,7 @@ class lambertian : public material
 
 public:
     lambertian(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
+    lambertian(scene_arena &arena, const color &albedo) : tex(arena.make<solid_color>(albedo)) {}
     lambertian(shared_ptr<texture> tex) : tex(tex) {}
 
     virtual bool scatter(const ray &r_in, const hitrecord &rec, color &attenuation, ray &scattered) const override
@@ -36,6 +57,23 @@ public:
         attenuation = tex->value(rec.u, rec.v, rec.position);
         return true;
     }
+    bool is_diffuse() const override { return true; }
+    bool is_specular() const override { return false; }
+    color eval(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const override
+    {
+        if (dot(wi, rec.normal) <= 0 || dot(wo, rec.normal) <= 0)
+            return color(0, 0, 0);
+        return tex->value(rec.u, rec.v, rec.position) / PI;
+    }
+    float pdf(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const override
+    {
+        return std::max(0.0f, dot(unit(wo), rec.normal)) / PI;
+    }
+    bool save(snapshot_writer &out, snapshot_material &record) const override
+    {
+        record = {snapshot_lambertian, out.texture_index(tex.get()), 0, 0, color(0, 0, 0)};
+        return true;
+    }
 };
 
 class metal : public material
@@ -48,11 +86,16 @@ public:
     virtual bool scatter(const ray &r_in, const hitrecord &rec, color &attenuation, ray &scattered) const override
     {
         vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit(reflected) + (fuzziness * random_unit_vector());
+        reflected = unit_fast(reflected) + (fuzziness * random_unit_vector());
         scattered = ray(rec.position, reflected, r_in.time());
         attenuation = albedo;
         return dot(scattered.direction(), rec.normal) > 0;
     }
+    bool save(snapshot_writer &out, snapshot_material &record) const override
+    {
+        record = {snapshot_metal, snapshot_none, fuzziness, 0, albedo};
+        return true;
+    }
 };
 
 class dielectric : public material
@@ -72,7 +115,7 @@ public:
     {
         attenuation = vec3(1., 1., 1.);
         float ri = rec.frontface ? (1. / refractive_index) : refractive_index;
-        vec3 unit_direction = unit(r_in.direction());
+        vec3 unit_direction = unit_fast(r_in.direction());
 
         auto cos_theta = fminf(dot(-unit_direction, rec.normal), 1.0);
         auto sin_theta = sqrt(1 - cos_theta * cos_theta);
@@ -88,6 +131,11 @@ public:
         scattered = ray(rec.position, direction, r_in.time());
         return true;
     }
+    bool save(snapshot_writer &out, snapshot_material &record) const override
+    {
+        record = {snapshot_dielectric, snapshot_none, refractive_index, 0, color(0, 0, 0)};
+        return true;
+    }
 };
 
 class diffuse_light : public material
@@ -97,17 +145,25 @@ class diffuse_light : public material
 public:
     diffuse_light(shared_ptr<texture> tex) : tex(tex) {}
     diffuse_light(const color &emit) : tex(make_shared<solid_color>(emit)) {}
+    diffuse_light(scene_arena &arena, const color &emit) : tex(arena.make<solid_color>(emit)) {}
 
     color emitted(float u, float v, const vec3 &p) const override
     {
         return tex->value(u, v, p);
     }
+    bool is_emissive() const override { return true; }
+    bool save(snapshot_writer &out, snapshot_material &record) const override
+    {
+        record = {snapshot_diffuse_light, out.texture_index(tex.get()), 0, 0, color(0, 0, 0)};
+        return true;
+    }
 };
 
 class isotropic : public material
 {
 public:
     isotropic(const color &albedo) : tex(make_shared<solid_color>(albedo)) {}
+    isotropic(scene_arena &arena, const color &albedo) : tex(arena.make<solid_color>(albedo)) {}
     isotropic(shared_ptr<texture> tex) : tex(tex) {}
 
     bool scatter(const ray &r_in, const hitrecord &rec, color &attenuation, ray &scattered)
@@ -117,6 +173,18 @@ public:
         attenuation = tex->value(rec.u, rec.v, rec.position);
         return true;
     }
+    bool is_specular() const override { return false; }
+    bool is_volume() const override { return true; }
+    color eval(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const override
+    {
+        return tex->value(rec.u, rec.v, rec.position) / (4 * PI);
+    }
+    float pdf(const hitrecord &rec, const vec3 &wi, const vec3 &wo) const override { return 1 / (4 * PI); }
+    bool save(snapshot_writer &out, snapshot_material &record) const override
+    {
+        record = {snapshot_isotropic, out.texture_index(tex.get()), 0, 0, color(0, 0, 0)};
+        return true;
+    }
 
 private:
     shared_ptr<texture> tex;
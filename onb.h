@@ -0,0 +1,25 @@
+#pragma once
+
+#include "rtw.h"
+
+// Orthonormal basis built around a single direction, used to map locally sampled directions
+// (around +z) into world space.
+class onb
+{
+    vec3 axis[3];
+
+public:
+    onb(const vec3 &n)
+    {
+        axis[2] = unit(n);
+        vec3 a = (fabs(axis[2].x) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        axis[1] = unit(cross(axis[2], a));
+        axis[0] = cross(axis[2], axis[1]);
+    }
+
+    const vec3 &u() const { return axis[0]; }
+    const vec3 &v() const { return axis[1]; }
+    const vec3 &w() const { return axis[2]; }
+
+    vec3 transform(const vec3 &v) const { return (v.x * axis[0]) + (v.y * axis[1]) + (v.z * axis[2]); }
+};
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "rtw.h"
+#include "vec3.h"
+
+#include <cmath>
+#include <utility>
+
+// Gradient noise over a 256-cell lattice that repeats along each axis. Every lattice point gets
+// one of point_count random unit gradients through three permutation tables, and noise() blends
+// the gradients' ramps at the eight corners around p with a Hermite fade, giving values in about
+// [-1, 1]. noise4() evaluates four points in one pass over SSE lanes (the lattice lookups stay
+// scalar; the fades, ramps and blends do not), which turb() uses to sum four octaves at a time.
+class perlin
+{
+    static constexpr int point_count = 256;
+    // Gradients split by component, so noise4() can load one component for four corners at once.
+    float gx[point_count], gy[point_count], gz[point_count];
+    int perm_x[point_count], perm_y[point_count], perm_z[point_count];
+
+    static void generate_perm(int *p)
+    {
+        for (int i = 0; i < point_count; i++)
+            p[i] = i;
+        for (int i = point_count - 1; i > 0; i--)
+        {
+            int target = int(random_uint() % uint32_t(i + 1));
+            std::swap(p[i], p[target]);
+        }
+    }
+
+    int gradient(int i, int j, int k) const
+    {
+        return perm_x[i & 255] ^ perm_y[j & 255] ^ perm_z[k & 255];
+    }
+
+public:
+    // Draws the gradients and permutations from the calling thread's random sequence.
+    perlin()
+    {
+        for (int i = 0; i < point_count; i++)
+        {
+            vec3 g = unit(random_vec3(-1, 1));
+            gx[i] = g.x;
+            gy[i] = g.y;
+            gz[i] = g.z;
+        }
+        generate_perm(perm_x);
+        generate_perm(perm_y);
+        generate_perm(perm_z);
+    }
+
+    float noise(const vec3 &p) const
+    {
+        float fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+        float u = p.x - fx, v = p.y - fy, w = p.z - fz;
+        int i = int(fx), j = int(fy), k = int(fz);
+
+        float uu = u * u * (3 - 2 * u);
+        float vv = v * v * (3 - 2 * v);
+        float ww = w * w * (3 - 2 * w);
+        float sum = 0;
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++)
+                {
+                    int g = gradient(i + di, j + dj, k + dk);
+                    float ramp = gx[g] * (u - di) + gy[g] * (v - dj) + gz[g] * (w - dk);
+                    float weight = (di ? uu : 1 - uu) * (dj ? vv : 1 - vv) * (dk ? ww : 1 - ww);
+                    sum += weight * ramp;
+                }
+        return sum;
+    }
+
+    // noise() at the four points (x[n], y[n], z[n]), into out[n].
+    void noise4(const float x[4], const float y[4], const float z[4], float out[4]) const
+    {
+#if RT_SIMD_SSE
+        // SSE2 has no floor: truncate, then step down where that rounded a negative value up.
+        auto floor4 = [](__m128 a, __m128i &integer)
+        {
+            __m128i t = _mm_cvttps_epi32(a);
+            __m128 f = _mm_cvtepi32_ps(t);
+            __m128 over = _mm_cmpgt_ps(f, a);
+            integer = _mm_add_epi32(t, _mm_castps_si128(over)); // true lanes are -1
+            return _mm_sub_ps(f, _mm_and_ps(over, _mm_set1_ps(1.f)));
+        };
+        auto fade = [](__m128 t)
+        { return _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3.f), _mm_add_ps(t, t))); };
+
+        __m128 px = _mm_loadu_ps(x), py = _mm_loadu_ps(y), pz = _mm_loadu_ps(z);
+        __m128i ii, jj, kk;
+        __m128 u = _mm_sub_ps(px, floor4(px, ii));
+        __m128 v = _mm_sub_ps(py, floor4(py, jj));
+        __m128 w = _mm_sub_ps(pz, floor4(pz, kk));
+        alignas(16) int i[4], j[4], k[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(i), ii);
+        _mm_store_si128(reinterpret_cast<__m128i *>(j), jj);
+        _mm_store_si128(reinterpret_cast<__m128i *>(k), kk);
+
+        // Permutation entries of both lattice planes along each axis, looked up once per lane.
+        int hx[2][4], hy[2][4], hz[2][4];
+        for (int n = 0; n < 4; n++)
+            for (int d = 0; d < 2; d++)
+            {
+                hx[d][n] = perm_x[(i[n] + d) & 255];
+                hy[d][n] = perm_y[(j[n] + d) & 255];
+                hz[d][n] = perm_z[(k[n] + d) & 255];
+            }
+
+        __m128 one = _mm_set1_ps(1.f);
+        __m128 uu = fade(u), vv = fade(v), ww = fade(w);
+        __m128 sum = _mm_setzero_ps();
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++)
+                {
+                    alignas(16) float cx[4], cy[4], cz[4];
+                    for (int n = 0; n < 4; n++)
+                    {
+                        int g = hx[di][n] ^ hy[dj][n] ^ hz[dk][n];
+                        cx[n] = gx[g];
+                        cy[n] = gy[g];
+                        cz[n] = gz[g];
+                    }
+                    __m128 ramp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(cx), _mm_sub_ps(u, _mm_set1_ps(float(di)))),
+                                                        _mm_mul_ps(_mm_load_ps(cy), _mm_sub_ps(v, _mm_set1_ps(float(dj))))),
+                                             _mm_mul_ps(_mm_load_ps(cz), _mm_sub_ps(w, _mm_set1_ps(float(dk)))));
+                    __m128 weight = _mm_mul_ps(_mm_mul_ps(di ? uu : _mm_sub_ps(one, uu), dj ? vv : _mm_sub_ps(one, vv)),
+                                               dk ? ww : _mm_sub_ps(one, ww));
+                    sum = _mm_add_ps(sum, _mm_mul_ps(weight, ramp));
+                }
+        _mm_storeu_ps(out, sum);
+#else
+        for (int n = 0; n < 4; n++)
+            out[n] = noise(vec3(x[n], y[n], z[n]));
+#endif
+    }
+
+    // Sum of |noise| over depth octaves, each at twice the frequency and half the weight of the
+    // last.
+    float turb(const vec3 &p, int depth = 7) const
+    {
+        float sum = 0;
+        float frequency = 1, weight = 1;
+        for (int octave = 0; octave < depth; octave += 4)
+        {
+            alignas(16) float x[4], y[4], z[4], n[4];
+            for (int lane = 0; lane < 4; lane++)
+            {
+                x[lane] = frequency * p.x;
+                y[lane] = frequency * p.y;
+                z[lane] = frequency * p.z;
+                frequency *= 2;
+            }
+            noise4(x, y, z, n);
+            for (int lane = 0; lane < 4 && octave + lane < depth; lane++)
+            {
+                sum += weight * std::fabs(n[lane]);
+                weight *= 0.5f;
+            }
+        }
+        return sum;
+    }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "rtw.h"
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Caustic photon map. Photons leave the scene's emitters, and the ones that reach a diffuse surface
+// after one or more non-diffuse bounces (glass, mirrors, fog) - light paths a camera path can only
+// complete by luck - are stored there. Stored photons are sorted into a uniform grid of cells two
+// gather radii wide, so a lookup reads the photons of the eight cells around the query point from
+// contiguous memory.
+class photon_map
+{
+    struct photon
+    {
+        vec3 position;
+        vec3 direction;
+        color power;
+    };
+
+    struct cell_range
+    {
+        uint64_t key = 0;
+        uint32_t start = 0, end = 0;
+    };
+
+    std::vector<photon> photons;
+    std::vector<cell_range> cells; // open-addressed by key
+    std::vector<const hittable *> emitters; // sorted; the objects photons were emitted from
+    float radius = 0;
+    float inv_cell_size = 0;
+
+    static uint64_t cell_key(int x, int y, int z)
+    {
+        auto field = [](int v)
+        { return uint64_t(v + (1 << 20)) & 0x1fffff; };
+        return field(x) | field(y) << 21 | field(z) << 42 | 1ull << 63;
+    }
+
+    uint64_t cell_of(const vec3 &p) const
+    {
+        return cell_key(int(floor(p.x * inv_cell_size)), int(floor(p.y * inv_cell_size)), int(floor(p.z * inv_cell_size)));
+    }
+
+    const cell_range *find(uint64_t key) const
+    {
+        size_t mask = cells.size() - 1;
+        for (size_t slot = (key * 0x9e3779b97f4a7c15ull) >> 20 & mask;; slot = (slot + 1) & mask)
+        {
+            if (cells[slot].key == key)
+                return &cells[slot];
+            if (cells[slot].key == 0)
+                return nullptr;
+        }
+    }
+
+    // Follows one photon from a light and appends it to out if it lands as a caustic.
+    static void trace(const hittable &world, ray r, color power, int max_bounces, std::vector<photon> &out)
+    {
+        bool specular = false;
+        for (int bounce = 0; bounce < max_bounces; bounce++)
+        {
+            hitrecord rec;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return;
+            if (rec.mat->is_diffuse())
+            {
+                if (specular)
+                    out.push_back({rec.position, r.direction(), power});
+                return;
+            }
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+            power = power * attenuation;
+            r = scattered;
+            specular = true;
+        }
+    }
+
+public:
+    int max_bounces = 16;
+
+    bool empty() const { return photons.empty(); }
+    size_t size() const { return photons.size(); }
+    // Whether photons were emitted from object, so its light along caustic paths is in the map.
+    bool emits_from(const hittable *object) const
+    {
+        return std::binary_search(emitters.begin(), emitters.end(), object);
+    }
+
+    // Emits count photons from the emitters world.collect_lights() reports, with lights chosen in
+    // proportion to their power, and keeps the caustic ones for lookups of the given radius.
+    void build(const hittable &world, size_t count, float gather_radius)
+    {
+        photons.clear();
+        cells.clear();
+        emitters.clear();
+        radius = gather_radius;
+        inv_cell_size = 1 / (2 * radius);
+
+        std::vector<const hittable *> lights;
+        world.collect_lights(lights);
+        std::vector<float> cdf(1, 0);
+        for (const auto *light : lights)
+            cdf.push_back(cdf.back() + light->emitter().power);
+        if (count == 0 || cdf.back() <= 0)
+            return;
+        emitters = lights;
+        std::sort(emitters.begin(), emitters.end());
+
+        auto &pool = thread_pool::global();
+        const size_t chunk = 4096;
+        size_t chunks = (count + chunk - 1) / chunk;
+        std::vector<std::vector<photon>> found(chunks);
+        pool.parallel_for(chunks, [&](size_t c)
+                          {
+            size_t n = std::min(chunk, count - c * chunk);
+            for (size_t k = 0; k < n; k++)
+            {
+                size_t index = std::upper_bound(cdf.begin(), cdf.end(), random_float() * cdf.back()) - cdf.begin() - 1;
+                index = std::min(index, lights.size() - 1);
+                float pick = (cdf[index + 1] - cdf[index]) / cdf.back();
+
+                hitrecord rec;
+                float area = lights[index]->sample_surface(rec);
+                if (area <= 0 || pick <= 0)
+                    continue;
+                // diffuse_light emits from both sides of a surface. Photons leaving the inside of a
+                // closed emitter hit it again straight away and are dropped, as they should be.
+                vec3 normal = random_float() < 0.5f ? rec.normal : -rec.normal;
+
+                // Cosine-weighted emission: radiance * cos / (pdf_area * pdf_dir * pdf_side) = radiance * area * 2 pi.
+                vec3 direction = onb(normal).transform(random_cosine_direction());
+                color power = rec.mat->emitted(rec.u, rec.v, rec.position) * (2 * area * PI / (pick * count));
+                trace(world, ray(rec.position, direction, random_float()), power, max_bounces, found[c]);
+            } });
+
+        for (auto &f : found)
+            photons.insert(photons.end(), f.begin(), f.end());
+        std::sort(photons.begin(), photons.end(), [this](const photon &a, const photon &b)
+                  { return cell_of(a.position) < cell_of(b.position); });
+
+        size_t table = 16;
+        while (table < 2 * photons.size())
+            table <<= 1;
+        cells.assign(table, cell_range());
+        size_t mask = table - 1;
+        for (size_t start = 0; start < photons.size();)
+        {
+            uint64_t key = cell_of(photons[start].position);
+            size_t end = start;
+            while (end < photons.size() && cell_of(photons[end].position) == key)
+                end++;
+            size_t slot = (key * 0x9e3779b97f4a7c15ull) >> 20 & mask;
+            while (cells[slot].key != 0)
+                slot = (slot + 1) & mask;
+            cells[slot] = {key, uint32_t(start), uint32_t(end)};
+            start = end;
+        }
+    }
+
+    // Caustic photon flux arriving at p from the side normal faces, per unit area.
+    color flux_density(const vec3 &p, const vec3 &normal) const
+    {
+        if (photons.empty())
+            return color(0, 0, 0);
+
+        // The eight cells overlapping the gather sphere: the query cell and its neighbours on the
+        // side of each axis nearest to p.
+        vec3 g = inv_cell_size * p;
+        int base[3], step[3];
+        for (int a = 0; a < 3; a++)
+        {
+            base[a] = int(floor(g[a]));
+            step[a] = g[a] - base[a] < 0.5f ? -1 : 1;
+        }
+
+        color sum(0, 0, 0);
+        float radius_squared = radius * radius;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            const cell_range *c = find(cell_key(base[0] + (corner & 1 ? step[0] : 0),
+                                                base[1] + (corner & 2 ? step[1] : 0),
+                                                base[2] + (corner & 4 ? step[2] : 0)));
+            if (!c)
+                continue;
+            for (uint32_t i = c->start; i < c->end; i++)
+            {
+                const photon &ph = photons[i];
+                if ((ph.position - p).length_squared() <= radius_squared && dot(ph.direction, normal) < 0)
+                    sum += ph.power;
+            }
+        }
+        return sum / (PI * radius_squared);
+    }
+};
@@ -1,12 +1,13 @@
 #pragma once
 #include "rtw.h"
 #include "hittable.h"
-#include "hittable_list.h"
+#include "material.h"
 
 class quad : public hittable
 {
     vec3 Q, u, v, w, normal;
     float D;
+    float area;
     shared_ptr<material> mat;
     aabb bbox;
 
@@ -18,6 +19,7 @@ public:
         normal = unit(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+        area = n.length();
         set_bounding_box();
     }
 
@@ -54,11 +56,69 @@ public:
 
         rec.t = t;
         rec.position = intersection;
-        rec.mat = mat;
+        rec.mat = mat.get();
+        rec.object = this;
         rec.setNormal(r, normal);
 
         return true;
     }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        auto denom = dot(normal, r.direction());
+        if (fabs(denom) < 1e-8)
+            return false;
+        auto t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        vec3 planer_hitpt_vector = r.at(t) - Q;
+        hitrecord uv; // is_interior() may be overridden by shapes that need somewhere to put UVs
+        return is_interior(dot(w, cross(planer_hitpt_vector, v)), dot(w, cross(u, planer_hitpt_vector)), uv);
+    }
+
+    unsigned features() const override { return mat->is_emissive() ? unsigned(feature_emission) : 0u; }
+    void collect_lights(std::vector<const hittable *> &lights) const override
+    {
+        if (luminance(mat->emitted(0.5, 0.5, Q + 0.5 * (u + v))) > 0)
+            lights.push_back(this);
+    }
+    // Shapes that override is_interior() must override this too.
+    bool save(snapshot_writer &out) const override
+    {
+        bool light = luminance(mat->emitted(0.5, 0.5, Q + 0.5 * (u + v))) > 0;
+        out.add(snapshot_quad{Q, u, v, w, normal, D, area, out.material_index(mat.get()), snapshot_none}, light);
+        return true;
+    }
+    // diffuse_light emits from both faces, so the emission cone covers every direction.
+    emitter_info emitter() const override
+    {
+        return {bbox, normal, PI, luminance(mat->emitted(0.5, 0.5, Q + 0.5 * (u + v))) * area * PI};
+    }
+    float sample_surface(hitrecord &rec) const override
+    {
+        rec.u = random_float();
+        rec.v = random_float();
+        rec.position = Q + rec.u * u + rec.v * v;
+        rec.normal = normal;
+        rec.frontface = true;
+        rec.mat = mat.get();
+        rec.object = this;
+        return area;
+    }
+    vec3 random(const vec3 &origin) const override
+    {
+        return Q + (random_float() * u) + (random_float() * v) - origin;
+    }
+    float pdf_value(const vec3 &origin, const vec3 &direction) const override
+    {
+        hitrecord rec;
+        if (!hit(ray(origin, direction), interval(0.001, infinity), rec))
+            return 0;
+
+        float distance_squared = rec.t * rec.t * direction.length_squared();
+        float cosine = fabs(dot(direction, normal) / direction.length());
+        return distance_squared / (cosine * area);
+    }
     virtual bool is_interior(float a, float b, hitrecord &rec) const
     {
         interval unit_interval = interval(0, 1);
@@ -70,23 +130,3 @@ public:
         return true;
     }
 };
-
-inline shared_ptr<hittable_list> box(const vec3 &a, const vec3 &b, shared_ptr<material> mat)
-{
-    auto sides = make_shared<hittable_list>();
-
-    auto min = vec3(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z));
-    auto max = vec3(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z));
-
-    auto dx = vec3(max.x - min.x, 0, 0);
-    auto dy = vec3(0, max.y - min.y, 0);
-    auto dz = vec3(0, 0, max.z - min.z);
-
-    sides->add(make_shared<quad>(vec3(min.x, min.y, max.z), dx, dy, mat));  // front
-    sides->add(make_shared<quad>(vec3(max.x, min.y, max.z), -dz, dy, mat)); // right
-    sides->add(make_shared<quad>(vec3(max.x, min.y, min.z), -dx, dy, mat)); // back
-    sides->add(make_shared<quad>(vec3(min.x, min.y, min.z), dz, dy, mat));  // left
-    sides->add(make_shared<quad>(vec3(min.x, max.y, max.z), dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(vec3(min.x, min.y, min.z), dx, dz, mat));  // bottom
-    return sides;
-}
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "rtw.h"
+#include "aabb.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// World-space hash grid of outgoing radiance at diffuse surfaces. Cells are keyed by the position
+// quantized to the grid and by the dominant axis of the surface normal, so the two sides of a thin
+// wall or the faces meeting at a corner stay apart. Path vertices add their estimates as they are
+// traced (from any thread), and a cell answers lookups once it holds min_samples of them. Using it
+// trades bias (radiance is averaged over a cell) for much shorter paths; smaller cells and a higher
+// min_samples reduce the bias at the cost of a slower fill.
+class radiance_cache
+{
+    struct cell
+    {
+        std::atomic<uint64_t> key{0};
+        std::atomic<uint32_t> count{0};
+        std::atomic<float> sum[3] = {};
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+    float inv_cell_size;
+    vec3 origin;
+
+    static constexpr int max_probes = 8;
+
+    static void add(std::atomic<float> &target, float value)
+    {
+        float current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t hash(const vec3 &p, const vec3 &n) const
+    {
+        vec3 g = inv_cell_size * (p - origin);
+        int axis = fabs(n.x) > fabs(n.y) ? (fabs(n.x) > fabs(n.z) ? 0 : 2) : (fabs(n.y) > fabs(n.z) ? 1 : 2);
+        uint64_t side = uint64_t(axis * 2 + (n[axis] < 0));
+
+        uint64_t h = side;
+        for (int a = 0; a < 3; a++)
+        {
+            h ^= uint64_t(int64_t(floor(g[a]))) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+            h ^= h >> 31;
+            h *= 0xbf58476d1ce4e5b9ull;
+        }
+        return h | 1; // zero marks an empty slot
+    }
+
+    cell *find(uint64_t key, bool insert) const
+    {
+        for (int probe = 0; probe < max_probes; probe++)
+        {
+            cell &c = cells[(key + probe) & mask];
+            uint64_t existing = c.key.load(std::memory_order_acquire);
+            if (existing == key)
+                return &c;
+            if (existing == 0)
+            {
+                if (!insert)
+                    return nullptr;
+                if (c.key.compare_exchange_strong(existing, key) || existing == key)
+                    return &c;
+            }
+        }
+        return nullptr;
+    }
+
+public:
+    int min_samples = 16;
+
+    // Cells are bounds' longest extent / resolution wide. capacity is rounded up to a power of two;
+    // when it runs out, new cells are simply not cached.
+    radiance_cache(const aabb &bounds, int resolution, size_t capacity = 1 << 18)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        cells.reset(new cell[size]);
+        mask = size - 1;
+
+        int axis = bounds.longest_axis();
+        float extent = bounds.axis_interval(axis).size();
+        inv_cell_size = extent > 0 ? resolution / extent : 1;
+        origin = vec3(bounds.x.min, bounds.y.min, bounds.z.min);
+    }
+
+    void record(const vec3 &p, const vec3 &n, const color &radiance)
+    {
+        if (!(radiance.x >= 0 && radiance.y >= 0 && radiance.z >= 0 && radiance.x < infinity &&
+              radiance.y < infinity && radiance.z < infinity))
+            return;
+        cell *c = find(hash(p, n), true);
+        if (!c)
+            return;
+        add(c->sum[0], radiance.x);
+        add(c->sum[1], radiance.y);
+        add(c->sum[2], radiance.z);
+        c->count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool lookup(const vec3 &p, const vec3 &n, color &radiance) const
+    {
+        const cell *c = find(hash(p, n), false);
+        if (!c)
+            return false;
+        uint32_t count = c->count.load(std::memory_order_relaxed);
+        if (count < uint32_t(min_samples))
+            return false;
+        radiance = color(c->sum[0].load(std::memory_order_relaxed), c->sum[1].load(std::memory_order_relaxed),
+                         c->sum[2].load(std::memory_order_relaxed)) /
+                   float(count);
+        return true;
+    }
+};
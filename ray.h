@@ -5,15 +5,18 @@ class ray
 {
     vec3 orig;
     vec3 dir;
+    // Per-axis reciprocal of dir, computed once per ray for the slab tests in aabb::hit.
+    vec3 inv_dir;
     float tm;
 
 public:
     ray() {}
-    ray(const vec3 &origin, const vec3 &direction) : orig(origin), dir(direction), tm(0) {}
-    ray(const vec3 &origin, const vec3 &direction, float time) : orig(origin), dir(direction), tm(time) {}
+    ray(const vec3 &origin, const vec3 &direction) : orig(origin), dir(direction), inv_dir(rcp(direction)), tm(0) {}
+    ray(const vec3 &origin, const vec3 &direction, float time) : orig(origin), dir(direction), inv_dir(rcp(direction)), tm(time) {}
 
     const vec3 &origin() const { return orig; }
     const vec3 &direction() const { return dir; }
+    const vec3 &inv_direction() const { return inv_dir; }
     const float time() const { return tm; }
 
     vec3 at(float t) const
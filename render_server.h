@@ -0,0 +1,383 @@
+#pragma once
+
+#include "rtw.h"
+#include "scene.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Long-running render daemon for pipelines that submit many renders of the same scenes. Clients
+// connect to a UNIX socket and send one request line:
+//
+//     render <scene> [width=N] [spp=N] [depth=N] [vfov=F] [lookfrom=x,y,z] [lookat=x,y,z] [priority=N] [id=name]
+//     cancel <id>
+//     status
+//
+// A render request gets its image back over the same connection as a PPM, written band by band as
+// the rows finish, and the connection then closes; failures come back as one "error: ..." line.
+// Built scenes (world, BVH and camera) stay resident in an LRU cache keyed by a hash of the scene
+// name, so repeat jobs skip building them. Jobs run one at a time on every thread of the global
+// pool, highest priority first and in arrival order among equals. Cancelling a job, or hanging up
+// on it, drops it from the queue or stops it mid-render.
+class render_server
+{
+public:
+    // Fills s with the named scene; false if there is no such scene.
+    using scene_builder = std::function<bool(const std::string &name, scene &s)>;
+
+    size_t cache_capacity = 4; // resident scenes
+    int band_height = 16;      // rows per streamed band
+
+    explicit render_server(scene_builder build) : build(std::move(build)) {}
+
+    // Accepts connections until the process is killed. Returns false if the socket could not be
+    // set up.
+    bool serve(const std::string &socket_path)
+    {
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (listener < 0 || socket_path.size() >= sizeof(address.sun_path))
+            return false;
+        std::strcpy(address.sun_path, socket_path.c_str());
+        unlink(socket_path.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || listen(listener, 64) < 0)
+        {
+            close(listener);
+            return false;
+        }
+        std::clog << "Serving on " << socket_path << std::endl;
+
+        std::thread([this]
+                    { dispatch(); })
+            .detach();
+        while (true)
+        {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0)
+                continue;
+            std::thread([this, client]
+                        { handle(client); })
+                .detach();
+        }
+    }
+
+private:
+    struct job
+    {
+        std::string id;
+        std::string scene_name;
+        int priority = 0;
+        uint64_t order = 0;
+        int width = 0, samples_per_pixel = 0, max_depth = 0; // 0 keeps the scene's own setting
+        float vfov = 0;
+        bool has_lookfrom = false, has_lookat = false;
+        vec3 lookfrom, lookat;
+
+        int client = -1;
+        std::atomic<bool> cancel{false};
+        bool done = false;
+        std::string error;
+        std::condition_variable finished;
+    };
+
+    struct cache_entry
+    {
+        uint64_t key;
+        shared_ptr<scene> resident;
+    };
+
+    // Writes to a client socket. A failed send means the client hung up, which cancels its job.
+    class socket_buffer : public std::streambuf
+    {
+        int fd;
+        std::atomic<bool> &cancel;
+        char buffer[1 << 16];
+
+        bool drain()
+        {
+            const char *p = pbase();
+            while (p < pptr() && !cancel.load(std::memory_order_relaxed))
+            {
+                ssize_t sent = send(fd, p, pptr() - p, MSG_NOSIGNAL);
+                if (sent <= 0)
+                    cancel = true;
+                else
+                    p += sent;
+            }
+            setp(buffer, buffer + sizeof(buffer));
+            return !cancel.load(std::memory_order_relaxed);
+        }
+
+    public:
+        socket_buffer(int fd, std::atomic<bool> &cancel) : fd(fd), cancel(cancel) { setp(buffer, buffer + sizeof(buffer)); }
+        ~socket_buffer() override { drain(); }
+
+        int overflow(int c) override
+        {
+            drain();
+            if (c != traits_type::eof())
+            {
+                *pptr() = char(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+        int sync() override { return drain() ? 0 : -1; }
+    };
+
+    scene_builder build;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::vector<shared_ptr<job>> queue;
+    shared_ptr<job> running;
+    uint64_t next_order = 0;
+    std::list<cache_entry> resident; // most recently used first; touched by the dispatcher only
+
+    static uint64_t scene_hash(const std::string &name)
+    {
+        uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+        for (unsigned char c : name)
+            h = (h ^ c) * 0x100000001b3ull;
+        return h;
+    }
+
+    static void reply(int fd, const std::string &text) { send(fd, text.data(), text.size(), MSG_NOSIGNAL); }
+
+    static std::string read_line(int fd)
+    {
+        std::string line;
+        char c;
+        while (line.size() < 4096 && recv(fd, &c, 1, 0) == 1 && c != '\n')
+            line += c;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        return line;
+    }
+
+    static bool parse_vec3(const std::string &text, vec3 &v)
+    {
+        return std::sscanf(text.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+    }
+
+    // Fills in j from the options after the scene name. Returns the offending option, or empty.
+    static std::string parse_options(std::istringstream &in, job &j)
+    {
+        std::string option;
+        while (in >> option)
+        {
+            auto equals = option.find('=');
+            if (equals == std::string::npos)
+                return option;
+            std::string key = option.substr(0, equals), value = option.substr(equals + 1);
+            bool ok = true;
+            if (key == "width")
+                ok = (j.width = atoi(value.c_str())) > 0;
+            else if (key == "spp")
+                ok = (j.samples_per_pixel = atoi(value.c_str())) > 0;
+            else if (key == "depth")
+                ok = (j.max_depth = atoi(value.c_str())) > 0;
+            else if (key == "vfov")
+                ok = (j.vfov = atof(value.c_str())) > 0;
+            else if (key == "lookfrom")
+                ok = j.has_lookfrom = parse_vec3(value, j.lookfrom);
+            else if (key == "lookat")
+                ok = j.has_lookat = parse_vec3(value, j.lookat);
+            else if (key == "priority")
+                j.priority = atoi(value.c_str());
+            else if (key == "id")
+                j.id = value;
+            else
+                ok = false;
+            if (!ok)
+                return option;
+        }
+        return "";
+    }
+
+    void handle(int client)
+    {
+        std::istringstream in(read_line(client));
+        std::string command;
+        in >> command;
+
+        if (command == "render")
+        {
+            auto j = make_shared<job>();
+            std::string bad;
+            if (!(in >> j->scene_name))
+                bad = "missing scene";
+            else
+                bad = parse_options(in, *j);
+            if (!bad.empty())
+            {
+                reply(client, "error: bad request: " + bad + "\n");
+                close(client);
+                return;
+            }
+            j->client = client;
+
+            std::unique_lock<std::mutex> lock(mutex);
+            j->order = next_order++;
+            if (j->id.empty())
+                j->id = "job" + std::to_string(j->order);
+            queue.push_back(j);
+            queued.notify_one();
+            j->finished.wait(lock, [&]
+                             { return j->done; });
+            lock.unlock();
+            if (!j->error.empty())
+                reply(client, "error: " + j->error + "\n");
+        }
+        else if (command == "cancel")
+        {
+            std::string id;
+            in >> id;
+            reply(client, cancel(id) ? "cancelled " + id + "\n" : "error: no job " + id + "\n");
+        }
+        else if (command == "status")
+            reply(client, status());
+        else
+            reply(client, "error: unknown command " + command + "\n");
+        close(client);
+    }
+
+    bool cancel(const std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running && running->id == id)
+        {
+            running->cancel = true;
+            return true;
+        }
+        for (auto it = queue.begin(); it != queue.end(); ++it)
+            if ((*it)->id == id)
+            {
+                (*it)->error = "cancelled";
+                (*it)->done = true;
+                (*it)->finished.notify_all();
+                queue.erase(it);
+                return true;
+            }
+        return false;
+    }
+
+    std::string status()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ostringstream out;
+        if (running)
+            out << "running " << running->id << ' ' << running->scene_name << '\n';
+        for (const auto &j : queue)
+            out << "queued " << j->id << ' ' << j->scene_name << " priority " << j->priority << '\n';
+        out << "resident scenes " << resident.size() << " of " << cache_capacity << '\n';
+        return out.str();
+    }
+
+    // The named scene from the cache, built and inserted on a miss.
+    shared_ptr<scene> acquire(const std::string &name, bool &hit)
+    {
+        uint64_t key = scene_hash(name);
+        for (auto it = resident.begin(); it != resident.end(); ++it)
+            if (it->key == key)
+            {
+                resident.splice(resident.begin(), resident, it);
+                hit = true;
+                return it->resident;
+            }
+
+        hit = false;
+        auto s = make_shared<scene>();
+        seed_random(1); // scenes with random content come out the same every time
+        if (!build(name, *s))
+            return nullptr;
+        resident.push_front({key, s});
+        if (resident.size() > cache_capacity)
+            resident.pop_back();
+        return s;
+    }
+
+    void dispatch()
+    {
+        while (true)
+        {
+            shared_ptr<job> j;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [this]
+                            { return !queue.empty(); });
+                auto best = queue.begin();
+                for (auto it = queue.begin(); it != queue.end(); ++it)
+                    if ((*it)->priority > (*best)->priority)
+                        best = it;
+                j = *best;
+                queue.erase(best);
+                running = j;
+            }
+
+            run(*j);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            running = nullptr;
+            j->done = true;
+            j->finished.notify_all();
+        }
+    }
+
+    void run(job &j)
+    {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        bool hit;
+        auto s = acquire(j.scene_name, hit);
+        if (!s)
+        {
+            j.error = "unknown scene " + j.scene_name;
+            return;
+        }
+        float setup = std::chrono::duration<float>(clock::now() - start).count();
+
+        camera cam = s->cam;
+        if (j.width > 0)
+            cam.image_width = j.width;
+        if (j.samples_per_pixel > 0)
+            cam.samples_per_pixel = j.samples_per_pixel;
+        if (j.max_depth > 0)
+            cam.max_depth = j.max_depth;
+        if (j.vfov > 0)
+            cam.vfov = j.vfov;
+        if (j.has_lookfrom)
+            cam.lookfrom = j.lookfrom;
+        if (j.has_lookat)
+            cam.lookat = j.lookat;
+        cam.band_height = band_height;
+        cam.progressive = false;
+        cam.preview = nullptr;
+        cam.cancel = &j.cancel;
+
+        {
+            socket_buffer buffer(j.client, j.cancel);
+            std::ostream out(&buffer);
+            cam.render(s->world, out);
+        }
+        std::clog << j.id << ": " << j.scene_name << (hit ? " (resident)" : " (built)") << ", setup " << setup
+                  << " s, total " << std::chrono::duration<float>(clock::now() - start).count() << " s"
+                  << (j.cancel ? ", cancelled" : "") << std::endl;
+    }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <limits>
 #include <memory>
@@ -16,7 +18,25 @@ constexpr float PI = 3.1415926535897932385;
 
 inline float to_radians(float degrees) { return degrees * PI / 180.0; }
 
-inline float random_float() { return rand() / (RAND_MAX + 1.0); }
+// PCG32 generator with one stream per thread, so worker threads neither contend on nor share the
+// C library's rand() state. seed_random() makes the calling thread's sequence reproducible.
+inline uint64_t &random_state()
+{
+    static std::atomic<uint64_t> next_stream{0};
+    thread_local uint64_t state = 0x853c49e6748fea9bULL + 0x9e3779b97f4a7c15ULL * next_stream++;
+    return state;
+}
+inline void seed_random(uint64_t seed) { random_state() = 0x853c49e6748fea9bULL ^ (seed * 0x9e3779b97f4a7c15ULL); }
+inline uint32_t random_uint()
+{
+    uint64_t &state = random_state();
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = uint32_t(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+inline float random_float() { return (random_uint() >> 8) * 0x1p-24f; }
 inline float random_float(float min, float max) { return min + (max - min) * random_float(); }
 
 #include "color.h"
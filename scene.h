@@ -0,0 +1,15 @@
+#pragma once
+
+#include "rtw.h"
+#include "arena.h"
+#include "camera.h"
+#include "hittable_list.h"
+
+// A built scene: its objects, the arena that owns them and the camera it is meant to be viewed
+// through. Image size and sample count are left for whoever renders it.
+struct scene
+{
+    scene_arena arena;
+    hittable_list world;
+    camera cam;
+};
@@ -0,0 +1,556 @@
+#pragma once
+
+#include "rtw.h"
+#include "arena.h"
+#include "hittable.h"
+#include "material.h"
+#include "quad.h"
+#include "scene.h"
+#include "snapshot_format.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary scene snapshots for scenes that are rendered over and over. A snapshot holds the camera,
+// the primitives, material and texture tables and the scene's already built BVH, flattened into
+// arrays that refer to each other by index and to the file by offset. mapped_scene maps it
+// read-only and traces straight out of the mapping, so loading costs a few page faults instead of
+// a parse and a BVH build, and every process rendering the same snapshot shares one copy in the
+// page cache. Only materials, textures and emitters (a handful of objects) are rebuilt on load.
+//
+// Spheres, quads, BVHs and hittable_lists of them can be saved; scenes with other objects, or
+// with environment lighting, cannot.
+
+// Writes s to path, replacing any existing file atomically so processes that still map the old
+// one are unaffected. On failure returns false and says why in error.
+inline bool write_snapshot(const scene &s, const std::string &path, std::string &error)
+{
+    if (s.cam.environment)
+    {
+        error = "environment lighting cannot be saved in a snapshot";
+        return false;
+    }
+    snapshot_writer out;
+    if (!s.world.save(out))
+    {
+        error = "the scene has objects a snapshot cannot hold";
+        return false;
+    }
+    std::vector<snapshot_material> materials;
+    for (const auto *m : out.materials)
+    {
+        snapshot_material record;
+        if (!m->save(out, record))
+        {
+            error = "the scene has materials a snapshot cannot hold";
+            return false;
+        }
+        materials.push_back(record);
+    }
+    // Saving a texture can add its children to the table, so this loop may grow it as it goes.
+    std::vector<snapshot_texture> textures;
+    for (size_t i = 0; i < out.textures.size(); i++)
+    {
+        snapshot_texture record;
+        if (!out.textures[i]->save(out, record))
+        {
+            error = "the scene has textures a snapshot cannot hold";
+            return false;
+        }
+        textures.push_back(record);
+    }
+
+    snapshot_header header = {};
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.byte_order = snapshot_byte_order;
+    header.features = s.world.features();
+    header.bounds = s.world.bounding_box();
+    const camera &cam = s.cam;
+    header.camera = {cam.aspect_ratio, cam.image_width, cam.samples_per_pixel, cam.max_depth, cam.background,
+                     cam.lookfrom, cam.lookat, cam.vup, cam.vfov, cam.defocus_angle, cam.focus_dist, 0};
+
+    // Tables follow the header, each starting on a cache line.
+    std::vector<std::pair<const void *, size_t>> tables;
+    uint64_t offset = sizeof(header);
+    auto place = [&](snapshot_section &section, const auto &table)
+    {
+        offset = (offset + 63) & ~uint64_t(63);
+        section = {offset, table.size()};
+        size_t bytes = table.size() * sizeof(table[0]);
+        tables.push_back({table.data(), bytes});
+        offset += bytes;
+    };
+    place(header.nodes, out.nodes);
+    place(header.end_bounds, out.end_bounds);
+    place(header.spheres, out.spheres);
+    place(header.quads, out.quads);
+    place(header.lights, out.lights);
+    place(header.materials, materials);
+    place(header.textures, textures);
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        uint64_t written = sizeof(header);
+        const char zeros[64] = {};
+        const snapshot_section *sections = &header.nodes;
+        for (size_t i = 0; i < tables.size(); i++)
+        {
+            file.write(zeros, sections[i].offset - written);
+            file.write(static_cast<const char *>(tables[i].first), tables[i].second);
+            written = sections[i].offset + tables[i].second;
+        }
+        if (!file)
+        {
+            error = "could not write " + temporary;
+            return false;
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        error = "could not replace " + path;
+        return false;
+    }
+    return true;
+}
+
+// A snapshot mapped into memory, traced in place.
+class mapped_scene : public hittable
+{
+    std::string path;
+    void *mapping = MAP_FAILED;
+    size_t mapping_size = 0;
+    snapshot_header header = {}; // copied, so it outlives unmap()
+    const snapshot_node *nodes = nullptr;
+    const aabb *end_bounds = nullptr;
+    const snapshot_sphere *spheres = nullptr;
+    const snapshot_quad *quads = nullptr;
+
+    scene_arena arena;
+    std::vector<const material *> materials;
+    std::vector<const hittable *> lights;
+    std::string shading; // the material, texture and light tables open() built those from
+
+    template <typename T>
+    bool map_section(const snapshot_section &section, const T *&table) const
+    {
+        if (section.offset % alignof(T) != 0 || section.offset > mapping_size ||
+            section.count > (mapping_size - section.offset) / sizeof(T))
+            return false;
+        table = reinterpret_cast<const T *>(static_cast<const char *>(mapping) + section.offset);
+        return true;
+    }
+
+    // The hit point of a sphere or quad record, the same way sphere::hit and quad::hit find it.
+    bool hit_sphere(const snapshot_sphere &s, const ray &r, interval ray_t, hitrecord &rec) const
+    {
+        vec3 center = s.moving ? s.center + r.time() * s.motion : s.center;
+        vec3 oc = center - r.origin();
+        float a = r.direction().length_squared();
+        float h = dot(r.direction(), oc);
+        float c = oc.length_squared() - s.radius * s.radius;
+        float discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        float sqrtd = sqrt(discriminant);
+        float root = (h - sqrtd) / a;
+        if (!ray_t.surrounds(root))
+        {
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        rec.t = root;
+        rec.position = r.at(root);
+        vec3 normal = (rec.position - center) / s.radius;
+        rec.setNormal(r, normal);
+        sphere::get_sphere_uv(normal, rec.u, rec.v);
+        rec.mat = materials[s.material];
+        rec.object = s.light != snapshot_none ? lights[s.light] : this;
+        return true;
+    }
+    bool sphere_occluded(const snapshot_sphere &s, const ray &r, interval ray_t) const
+    {
+        vec3 oc = (s.moving ? s.center + r.time() * s.motion : s.center) - r.origin();
+        float a = r.direction().length_squared();
+        float h = dot(r.direction(), oc);
+        float c = oc.length_squared() - s.radius * s.radius;
+        float discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+        float sqrtd = sqrt(discriminant);
+        return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+    }
+    // Plane distance and in-quad coordinates of r against q; false if it misses.
+    static bool quad_intersect(const snapshot_quad &q, const ray &r, interval ray_t, float &t, float &alpha, float &beta)
+    {
+        float denom = dot(q.normal, r.direction());
+        if (fabs(denom) < 1e-8)
+            return false;
+        t = (q.D - dot(q.normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+        vec3 planar = r.at(t) - q.Q;
+        alpha = dot(q.w, cross(planar, q.v));
+        beta = dot(q.w, cross(q.u, planar));
+        interval unit_interval(0, 1);
+        return unit_interval.contains(alpha) && unit_interval.contains(beta);
+    }
+    bool hit_quad(const snapshot_quad &q, const ray &r, interval ray_t, hitrecord &rec) const
+    {
+        float t, alpha, beta;
+        if (!quad_intersect(q, r, ray_t, t, alpha, beta))
+            return false;
+        rec.u = alpha;
+        rec.v = beta;
+        rec.t = t;
+        rec.position = r.at(t);
+        rec.mat = materials[q.material];
+        rec.object = q.light != snapshot_none ? lights[q.light] : this;
+        rec.setNormal(r, q.normal);
+        return true;
+    }
+
+    bool hit_node(uint32_t index, const ray &r, interval ray_t, hitrecord &rec) const
+    {
+        const snapshot_node &node = nodes[index];
+        switch (node.kind)
+        {
+        case snapshot_sphere_leaf:
+            return hit_sphere(spheres[node.index], r, ray_t, rec);
+        case snapshot_quad_leaf:
+            return hit_quad(quads[node.index], r, ray_t, rec);
+        case snapshot_empty:
+            return false;
+        case snapshot_interior:
+            if (!node.bounds.hit(r, ray_t))
+                return false;
+            break;
+        case snapshot_interior_moving:
+            if (!lerp(node.bounds, end_bounds[node.motion], r.time()).hit(r, ray_t))
+                return false;
+            break;
+        }
+        bool hit_first = hit_node(index + 1, r, ray_t, rec);
+        bool hit_second = hit_node(node.index, r, interval(ray_t.min, hit_first ? rec.t : ray_t.max), rec);
+        return hit_first || hit_second;
+    }
+    bool node_occluded(uint32_t index, const ray &r, interval ray_t) const
+    {
+        const snapshot_node &node = nodes[index];
+        switch (node.kind)
+        {
+        case snapshot_sphere_leaf:
+            return sphere_occluded(spheres[node.index], r, ray_t);
+        case snapshot_quad_leaf:
+        {
+            float t, alpha, beta;
+            return quad_intersect(quads[node.index], r, ray_t, t, alpha, beta);
+        }
+        case snapshot_empty:
+            return false;
+        case snapshot_interior:
+            if (!node.bounds.hit(r, ray_t))
+                return false;
+            break;
+        case snapshot_interior_moving:
+            if (!lerp(node.bounds, end_bounds[node.motion], r.time()).hit(r, ray_t))
+                return false;
+            break;
+        }
+        return node_occluded(index + 1, r, ray_t) || node_occluded(node.index, r, ray_t);
+    }
+
+    // Maps path and points the tables into it. The material, texture and light tables are only
+    // needed by open(), which is given them through the last three arguments.
+    bool map(std::string &error, const snapshot_material *&material_table, const snapshot_texture *&texture_table,
+             const snapshot_light *&light_table)
+    {
+        error.clear();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            error = "could not open " + path;
+            return false;
+        }
+        mapping_size = size_t(info.st_size);
+        if (mapping_size >= sizeof(snapshot_header))
+            mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            error = path + " is not a snapshot";
+            return false;
+        }
+
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+            header.byte_order != snapshot_byte_order)
+            error = path + " is not a snapshot";
+        else if (header.version != snapshot_version)
+            error = path + " is snapshot version " + std::to_string(header.version) + ", expected " +
+                    std::to_string(snapshot_version);
+        else if (header.nodes.count == 0 || !map_section(header.nodes, nodes) ||
+                 !map_section(header.end_bounds, end_bounds) || !map_section(header.spheres, spheres) ||
+                 !map_section(header.quads, quads) || !map_section(header.lights, light_table) ||
+                 !map_section(header.materials, material_table) || !map_section(header.textures, texture_table))
+            error = path + " is truncated";
+        if (!error.empty())
+        {
+            unmap();
+            return false;
+        }
+        return true;
+    }
+
+    std::string shading_tables(const snapshot_material *material_table, const snapshot_texture *texture_table,
+                               const snapshot_light *light_table) const
+    {
+        std::string bytes(reinterpret_cast<const char *>(material_table), header.materials.count * sizeof(snapshot_material));
+        bytes.append(reinterpret_cast<const char *>(texture_table), header.textures.count * sizeof(snapshot_texture));
+        bytes.append(reinterpret_cast<const char *>(light_table), header.lights.count * sizeof(snapshot_light));
+        return bytes;
+    }
+
+    // Whether every index stored in the tables is in range, and children come after their parents
+    // (so traversal always moves forward through the node table and ends).
+    bool indices_valid(const snapshot_material *material_table, const snapshot_texture *texture_table,
+                       const snapshot_light *light_table) const
+    {
+        const auto &h = header;
+        auto in = [](uint64_t index, uint64_t count)
+        { return index < count; };
+        auto light_ok = [&](uint32_t light)
+        { return light == snapshot_none || in(light, h.lights.count); };
+
+        for (uint64_t i = 0; i < h.nodes.count; i++)
+        {
+            const snapshot_node &node = nodes[i];
+            switch (node.kind)
+            {
+            case snapshot_sphere_leaf:
+                if (!in(node.index, h.spheres.count))
+                    return false;
+                break;
+            case snapshot_quad_leaf:
+                if (!in(node.index, h.quads.count))
+                    return false;
+                break;
+            case snapshot_empty:
+                break;
+            case snapshot_interior_moving:
+                if (!in(node.motion, h.end_bounds.count))
+                    return false;
+                [[fallthrough]];
+            case snapshot_interior:
+            case snapshot_group:
+                if (!in(i + 1, h.nodes.count) || node.index <= i + 1 || !in(node.index, h.nodes.count))
+                    return false;
+                break;
+            default:
+                return false;
+            }
+        }
+        for (uint64_t i = 0; i < h.spheres.count; i++)
+            if (!in(spheres[i].material, h.materials.count) || !light_ok(spheres[i].light))
+                return false;
+        for (uint64_t i = 0; i < h.quads.count; i++)
+            if (!in(quads[i].material, h.materials.count) || !light_ok(quads[i].light))
+                return false;
+        for (uint64_t i = 0; i < h.lights.count; i++)
+        {
+            const snapshot_light &light = light_table[i];
+            if (!(light.kind == snapshot_sphere_leaf && in(light.index, h.spheres.count)) &&
+                !(light.kind == snapshot_quad_leaf && in(light.index, h.quads.count)))
+                return false;
+        }
+        for (uint64_t i = 0; i < h.materials.count; i++)
+        {
+            const snapshot_material &m = material_table[i];
+            if (m.kind > snapshot_isotropic)
+                return false;
+            bool textured = m.kind == snapshot_lambertian || m.kind == snapshot_diffuse_light || m.kind == snapshot_isotropic;
+            if (textured && !in(m.texture, h.textures.count))
+                return false;
+        }
+        for (uint64_t i = 0; i < h.textures.count; i++)
+        {
+            const snapshot_texture &t = texture_table[i];
+            if (t.kind == snapshot_checkered &&
+                (t.even <= i || t.odd <= i || !in(t.even, h.textures.count) || !in(t.odd, h.textures.count)))
+                return false;
+            if (t.kind > snapshot_checkered)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    mapped_scene() = default;
+    mapped_scene(const mapped_scene &) = delete;
+    mapped_scene &operator=(const mapped_scene &) = delete;
+    ~mapped_scene() override { unmap(); }
+
+    // Maps the snapshot at path. On failure returns false and says why in error.
+    bool open(const std::string &snapshot_path, std::string &error)
+    {
+        path = snapshot_path;
+        const snapshot_material *material_table = nullptr;
+        const snapshot_texture *texture_table = nullptr;
+        const snapshot_light *light_table = nullptr;
+        if (!map(error, material_table, texture_table, light_table))
+            return false;
+        if (!indices_valid(material_table, texture_table, light_table))
+        {
+            error = path + " is corrupt";
+            unmap();
+            return false;
+        }
+        shading = shading_tables(material_table, texture_table, light_table);
+
+        // Children come after their parents in the texture table, so build it back to front.
+        std::vector<shared_ptr<texture>> textures(header.textures.count);
+        for (size_t i = textures.size(); i-- > 0;)
+        {
+            const snapshot_texture &t = texture_table[i];
+            if (t.kind == snapshot_checkered)
+                textures[i] = arena.make<checkered_texture>(1 / t.inv_scale, textures[t.even], textures[t.odd]);
+            else
+                textures[i] = arena.make<solid_color>(t.albedo);
+        }
+        std::vector<shared_ptr<material>> owned(header.materials.count);
+        for (size_t i = 0; i < owned.size(); i++)
+        {
+            const snapshot_material &m = material_table[i];
+            switch (m.kind)
+            {
+            case snapshot_lambertian:
+                owned[i] = arena.make<lambertian>(textures[m.texture]);
+                break;
+            case snapshot_metal:
+                owned[i] = arena.make<metal>(m.albedo, m.parameter);
+                break;
+            case snapshot_dielectric:
+                owned[i] = arena.make<dielectric>(m.parameter);
+                break;
+            case snapshot_diffuse_light:
+                owned[i] = arena.make<diffuse_light>(textures[m.texture]);
+                break;
+            default:
+                owned[i] = arena.make<isotropic>(textures[m.texture]);
+                break;
+            }
+            materials.push_back(owned[i].get());
+        }
+        // Emitters become ordinary objects, so light sampling can draw points on them.
+        for (size_t i = 0; i < header.lights.count; i++)
+        {
+            const snapshot_light &light = light_table[i];
+            if (light.kind == snapshot_sphere_leaf)
+            {
+                const snapshot_sphere &s = spheres[light.index];
+                lights.push_back(arena.make<sphere>(s.center, s.radius, owned[s.material]).get());
+            }
+            else
+            {
+                const snapshot_quad &q = quads[light.index];
+                lights.push_back(arena.make<quad>(q.Q, q.u, q.v, owned[q.material]).get());
+            }
+        }
+        return true;
+    }
+
+    // Releases the mapped geometry but keeps the materials and emitters, which hit records may
+    // still point at. Nothing may be traced until remap().
+    void unmap()
+    {
+        if (mapping != MAP_FAILED)
+            munmap(mapping, mapping_size);
+        mapping = MAP_FAILED;
+        nodes = nullptr;
+        end_bounds = nullptr;
+        spheres = nullptr;
+        quads = nullptr;
+    }
+    // Maps the same file again after unmap(). Fails, leaving it unmapped, if the file has been
+    // replaced by one other than the snapshot open() read, whose tables the materials and emitters
+    // built then would not match.
+    bool remap(std::string &error)
+    {
+        if (mapping != MAP_FAILED)
+            return true;
+        const snapshot_material *material_table;
+        const snapshot_texture *texture_table;
+        const snapshot_light *light_table;
+        snapshot_header opened = header;
+        if (!map(error, material_table, texture_table, light_table))
+        {
+            header = opened;
+            return false;
+        }
+        if (std::memcmp(&header, &opened, sizeof(header)) != 0 ||
+            !indices_valid(material_table, texture_table, light_table) ||
+            shading_tables(material_table, texture_table, light_table) != shading)
+        {
+            error = path + " has changed since it was opened";
+            unmap();
+            header = opened;
+            return false;
+        }
+        return true;
+    }
+    bool is_mapped() const { return mapping != MAP_FAILED; }
+    size_t mapped_size() const { return mapping_size; }
+    // Asks for the whole file to be read in now, so tracing does not stop on page faults.
+    void prefetch() const
+    {
+        if (mapping == MAP_FAILED)
+            return;
+        madvise(mapping, mapping_size, MADV_WILLNEED);
+        char sum = 0;
+        for (size_t offset = 0; offset < mapping_size; offset += 4096)
+            sum += static_cast<const volatile char *>(mapping)[offset];
+        volatile char sink = sum;
+        (void)sink;
+    }
+
+    // Points cam the way the scene was saved, including its image size and sample count.
+    void apply(camera &cam) const
+    {
+        const snapshot_camera &c = header.camera;
+        cam.aspect_ratio = c.aspect_ratio;
+        cam.image_width = c.image_width;
+        cam.samples_per_pixel = c.samples_per_pixel;
+        cam.max_depth = c.max_depth;
+        cam.background = c.background;
+        cam.lookfrom = c.lookfrom;
+        cam.lookat = c.lookat;
+        cam.vup = c.vup;
+        cam.vfov = c.vfov;
+        cam.defocus_angle = c.defocus_angle;
+        cam.focus_dist = c.focus_dist;
+    }
+
+    bool hit(const ray &r, interval ray_t, hitrecord &rec) const override { return hit_node(0, r, ray_t, rec); }
+    bool occluded(const ray &r, interval ray_t) const override { return node_occluded(0, r, ray_t); }
+    aabb bounding_box() const override { return header.bounds; }
+    void collect_lights(std::vector<const hittable *> &out) const override { out.insert(out.end(), lights.begin(), lights.end()); }
+    unsigned features() const override { return header.features; }
+};
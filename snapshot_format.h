@@ -0,0 +1,204 @@
+#pragma once
+
+#include "rtw.h"
+#include "aabb.h"
+
+#include <cstdint>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+class material;
+class texture;
+
+// On-disk layout of a scene snapshot (see snapshot.h). Every record is plain data in this build's
+// native layout, so a mapped file is used in place; the version changes whenever a record does.
+constexpr char snapshot_magic[8] = {'R', 'T', 'S', 'N', 'A', 'P', 0, 0};
+constexpr uint32_t snapshot_version = 1;
+constexpr uint32_t snapshot_byte_order = 0x01020304;
+constexpr uint32_t snapshot_none = ~0u;
+
+enum snapshot_node_kind : uint32_t
+{
+    snapshot_interior,        // bounds tested, then the next node and the one at index
+    snapshot_interior_moving, // as above, bounds interpolated towards end_bounds[motion]
+    snapshot_group,           // no bounds test, as for the objects of a hittable_list
+    snapshot_sphere_leaf,     // spheres[index]
+    snapshot_quad_leaf,       // quads[index]
+    snapshot_empty            // hits nothing
+};
+
+struct snapshot_node
+{
+    aabb bounds;
+    uint32_t kind;
+    uint32_t index;  // second child of interior and group nodes (the first follows directly), or the primitive of a leaf
+    uint32_t motion; // end_bounds entry of a moving node
+    uint32_t unused;
+};
+
+struct snapshot_sphere
+{
+    vec3 center;
+    vec3 motion; // center at time 1 minus center at time 0
+    float radius;
+    uint32_t material;
+    uint32_t light; // lights entry for emitters that light sampling knows about, else snapshot_none
+    uint32_t moving;
+};
+
+struct snapshot_quad
+{
+    vec3 Q, u, v, w, normal;
+    float D;
+    float area;
+    uint32_t material;
+    uint32_t light;
+};
+
+struct snapshot_light
+{
+    uint32_t kind; // snapshot_sphere_leaf or snapshot_quad_leaf
+    uint32_t index;
+};
+
+enum snapshot_material_kind : uint32_t
+{
+    snapshot_lambertian,
+    snapshot_metal,
+    snapshot_dielectric,
+    snapshot_diffuse_light,
+    snapshot_isotropic
+};
+
+struct snapshot_material
+{
+    uint32_t kind;
+    uint32_t texture;
+    float parameter; // metal fuzz or dielectric refractive index
+    uint32_t unused;
+    color albedo;
+};
+
+enum snapshot_texture_kind : uint32_t
+{
+    snapshot_solid,
+    snapshot_checkered
+};
+
+struct snapshot_texture
+{
+    uint32_t kind;
+    uint32_t even, odd; // checkered children; always later in the table than their parent
+    float inv_scale;
+    color albedo;
+};
+
+struct snapshot_camera
+{
+    double aspect_ratio;
+    int32_t image_width;
+    int32_t samples_per_pixel;
+    int32_t max_depth;
+    color background;
+    vec3 lookfrom, lookat, vup;
+    float vfov;
+    float defocus_angle;
+    float focus_dist;
+    uint32_t unused;
+};
+
+// Where a table lives, as a byte offset from the start of the file, and how many records it has.
+struct snapshot_section
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t features; // render_feature bits of the scene
+    uint32_t unused;
+    aabb bounds;
+    snapshot_camera camera;
+    snapshot_section nodes, end_bounds, spheres, quads, lights, materials, textures;
+};
+
+static_assert(std::is_trivially_copyable_v<snapshot_node> && std::is_trivially_copyable_v<snapshot_sphere> &&
+                  std::is_trivially_copyable_v<snapshot_quad> && std::is_trivially_copyable_v<snapshot_header>,
+              "snapshot records are mapped straight from disk");
+
+// Gathers the tables of a snapshot while the scene's objects save() themselves into it. The BVH is
+// laid out depth first, so an interior node's first child is always the node after it.
+class snapshot_writer
+{
+    std::unordered_map<const void *, uint32_t> indices;
+
+    template <typename T>
+    uint32_t index_of(const T *source, std::vector<const T *> &table)
+    {
+        auto [it, inserted] = indices.try_emplace(source, uint32_t(table.size()));
+        if (inserted)
+            table.push_back(source);
+        return it->second;
+    }
+
+public:
+    std::vector<snapshot_node> nodes;
+    std::vector<aabb> end_bounds;
+    std::vector<snapshot_sphere> spheres;
+    std::vector<snapshot_quad> quads;
+    std::vector<snapshot_light> lights;
+    // Materials and textures in table order; their records are filled in once the geometry is done.
+    std::vector<const material *> materials;
+    std::vector<const texture *> textures;
+
+    uint32_t material_index(const material *m) { return index_of(m, materials); }
+    uint32_t texture_index(const texture *t) { return index_of(t, textures); }
+
+    // Starts an interior node, whose first child must be saved next. Returns the node for
+    // second_child().
+    size_t interior(const aabb &bounds)
+    {
+        nodes.push_back({bounds, snapshot_interior, 0, snapshot_none, 0});
+        return nodes.size() - 1;
+    }
+    size_t interior_moving(const aabb &start, const aabb &end)
+    {
+        nodes.push_back({start, snapshot_interior_moving, 0, uint32_t(end_bounds.size()), 0});
+        end_bounds.push_back(end);
+        return nodes.size() - 1;
+    }
+    size_t group()
+    {
+        nodes.push_back({aabb::universe, snapshot_group, 0, snapshot_none, 0});
+        return nodes.size() - 1;
+    }
+    // Call once the first child of node is saved: the second one starts here.
+    void second_child(size_t node) { nodes[node].index = uint32_t(nodes.size()); }
+
+    void empty() { nodes.push_back({aabb::empty, snapshot_empty, 0, snapshot_none, 0}); }
+    void add(const snapshot_sphere &s, bool light)
+    {
+        nodes.push_back({aabb::empty, snapshot_sphere_leaf, uint32_t(spheres.size()), snapshot_none, 0});
+        spheres.push_back(s);
+        if (light)
+        {
+            spheres.back().light = uint32_t(lights.size());
+            lights.push_back({snapshot_sphere_leaf, uint32_t(spheres.size() - 1)});
+        }
+    }
+    void add(const snapshot_quad &q, bool light)
+    {
+        nodes.push_back({aabb::empty, snapshot_quad_leaf, uint32_t(quads.size()), snapshot_none, 0});
+        quads.push_back(q);
+        if (light)
+        {
+            quads.back().light = uint32_t(lights.size());
+            lights.push_back({snapshot_quad_leaf, uint32_t(quads.size() - 1)});
+        }
+    }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 
 class sphere : public hittable
 {
@@ -12,25 +14,12 @@ private:
     vec3 center_vec;
     aabb bbox;
 
-public:
-    // Stationary
-    sphere(const vec3 &center, float radius, shared_ptr<material> mat) : center1(center), mRadius(radius), mat(mat), is_moving(false)
-    {
-        auto rvec = vec3(radius, radius, radius);
-        bbox = aabb(center1 - rvec, center1 + rvec);
-    }
-    sphere(const vec3 &center1, const vec3 &center2, float radius, shared_ptr<material> mat) : center1(center1), mRadius(radius), mat(mat), is_moving(true)
-    {
-        auto rvec = vec3(radius, radius, radius);
-        aabb box1(center1 - rvec, center1 + rvec);
-        aabb box2(center2 - rvec, center2 + rvec);
-        bbox = aabb(box1, box2);
-        center_vec = center2 - center1;
-    }
-    aabb bounding_box() const override { return bbox; }
-    virtual bool hit(const ray &r, interval ray_t, hitrecord &record) const override
+    // Intersection with the motion code compiled in or out, so stationary spheres never read the
+    // ray time.
+    template <bool Moving>
+    bool hit_at(const ray &r, interval ray_t, hitrecord &record) const
     {
-        vec3 center = is_moving ? sphere_center(r.time()) : center1;
+        vec3 center = Moving ? sphere_center(r.time()) : center1;
         vec3 oc = center - r.origin();
         float a = r.direction().length_squared();
         float h = dot(r.direction(), oc);
@@ -56,9 +45,112 @@ public:
         vec3 normal = (record.position - center) / mRadius;
         record.setNormal(r, normal);
         get_sphere_uv(normal, record.u, record.v);
-        record.mat = mat;
+        record.mat = mat.get();
+        record.object = this;
         return true;
     }
+
+public:
+    // Stationary
+    sphere(const vec3 &center, float radius, shared_ptr<material> mat) : center1(center), mRadius(radius), mat(mat), is_moving(false)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        bbox = aabb(center1 - rvec, center1 + rvec);
+    }
+    sphere(const vec3 &center1, const vec3 &center2, float radius, shared_ptr<material> mat) : center1(center1), mRadius(radius), mat(mat), is_moving(true)
+    {
+        auto rvec = vec3(radius, radius, radius);
+        aabb box1(center1 - rvec, center1 + rvec);
+        aabb box2(center2 - rvec, center2 + rvec);
+        bbox = aabb(box1, box2);
+        center_vec = center2 - center1;
+    }
+    aabb bounding_box() const override { return bbox; }
+    aabb bounding_box_at(float time) const override
+    {
+        if (!is_moving)
+            return bbox;
+        auto rvec = vec3(mRadius, mRadius, mRadius);
+        auto center = sphere_center(time);
+        return aabb(center - rvec, center + rvec);
+    }
+    bool hit(const ray &r, interval ray_t, hitrecord &record) const override
+    {
+        return is_moving ? hit_at<true>(r, ray_t, record) : hit_at<false>(r, ray_t, record);
+    }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        vec3 oc = (is_moving ? sphere_center(r.time()) : center1) - r.origin();
+        float a = r.direction().length_squared();
+        float h = dot(r.direction(), oc);
+        float c = oc.length_squared() - mRadius * mRadius;
+        float discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+        float sqrtd = sqrt(discriminant);
+        return ray_t.surrounds((h - sqrtd) / a) || ray_t.surrounds((h + sqrtd) / a);
+    }
+
+    unsigned features() const override
+    {
+        return (is_moving ? unsigned(feature_motion_blur) : 0u) | (mat->is_emissive() ? unsigned(feature_emission) : 0u);
+    }
+    void collect_lights(std::vector<const hittable *> &lights) const override
+    {
+        if (!is_moving && luminance(mat->emitted(0.5, 0.5, center1)) > 0)
+            lights.push_back(this);
+    }
+    bool save(snapshot_writer &out) const override
+    {
+        bool light = !is_moving && luminance(mat->emitted(0.5, 0.5, center1)) > 0;
+        out.add(snapshot_sphere{center1, is_moving ? center_vec : vec3(0, 0, 0), mRadius, out.material_index(mat.get()),
+                                snapshot_none, is_moving},
+                light);
+        return true;
+    }
+    emitter_info emitter() const override
+    {
+        float area = 4 * PI * mRadius * mRadius;
+        return {bbox, vec3(0, 0, 1), PI, luminance(mat->emitted(0.5, 0.5, center1)) * area * PI};
+    }
+    float sample_surface(hitrecord &rec) const override
+    {
+        vec3 normal = random_unit_vector();
+        rec.position = center1 + mRadius * normal;
+        rec.normal = normal;
+        rec.frontface = true;
+        get_sphere_uv(normal, rec.u, rec.v);
+        rec.mat = mat.get();
+        rec.object = this;
+        return 4 * PI * mRadius * mRadius;
+    }
+    // Uniform over the cone of directions subtended by the (stationary) sphere.
+    vec3 random(const vec3 &origin) const override
+    {
+        vec3 direction = center1 - origin;
+        float distance_squared = direction.length_squared();
+        if (distance_squared <= mRadius * mRadius)
+            return direction;
+
+        float r1 = random_float();
+        float r2 = random_float();
+        float z = 1 + r2 * (sqrt(1 - mRadius * mRadius / distance_squared) - 1);
+        float phi = 2 * PI * r1;
+        float sin_theta = sqrt(1 - z * z);
+        return onb(direction).transform(vec3(cos(phi) * sin_theta, sin(phi) * sin_theta, z));
+    }
+    float pdf_value(const vec3 &origin, const vec3 &direction) const override
+    {
+        hitrecord rec;
+        if (!hit(ray(origin, direction), interval(0.001, infinity), rec))
+            return 0;
+
+        float distance_squared = (center1 - origin).length_squared();
+        if (distance_squared <= mRadius * mRadius)
+            return 0;
+        float cos_theta_max = sqrt(1 - mRadius * mRadius / distance_squared);
+        return 1 / (2 * PI * (1 - cos_theta_max));
+    }
     vec3 sphere_center(float time) const
     {
         return center1 + time * center_vec;
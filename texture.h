@@ -1,12 +1,22 @@
 #pragma once
 
 #include "rtw.h"
+#include "aabb.h"
+#include "arena.h"
+#include "perlin.h"
+#include "snapshot_format.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <vector>
 
 class texture
 {
 public:
     virtual ~texture() = default;
     virtual color value(float u, float v, const vec3 &point) const = 0;
+    // Fills in this texture's snapshot record; false if snapshots cannot hold it.
+    virtual bool save(snapshot_writer &out, snapshot_texture &record) const { return false; }
 };
 
 class solid_color : public texture
@@ -17,6 +27,11 @@ public:
     solid_color(const color &albedo) : albedo(albedo) {}
     solid_color(float red, float green, float blue) : solid_color(color(red, green, blue)) {}
     color value(float u, float v, const vec3 &point) const override { return albedo; }
+    bool save(snapshot_writer &out, snapshot_texture &record) const override
+    {
+        record = {snapshot_solid, snapshot_none, snapshot_none, 0, albedo};
+        return true;
+    }
 };
 
 class checkered_texture : public texture
@@ -28,6 +43,8 @@ class checkered_texture : public texture
 public:
     checkered_texture(float scale, shared_ptr<texture> even, shared_ptr<texture> odd) : inv_scale(1.0 / scale), even(even), odd(odd) {}
     checkered_texture(float scale, const color &c1, const color &c2) : inv_scale(1.0 / scale), even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
+    checkered_texture(scene_arena &arena, float scale, const color &c1, const color &c2)
+        : inv_scale(1.0 / scale), even(arena.make<solid_color>(c1)), odd(arena.make<solid_color>(c2)) {}
     virtual color value(float u, float v, const vec3 &point) const override
     {
         auto xInteger = int(std::floor(inv_scale * point.x));
@@ -36,4 +53,123 @@ public:
         bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
         return isEven ? even->value(u, v, point) : odd->value(u, v, point);
     }
-};
\ No newline at end of file
+    bool save(snapshot_writer &out, snapshot_texture &record) const override
+    {
+        record = {snapshot_checkered, out.texture_index(even.get()), out.texture_index(odd.get()), inv_scale, color(0, 0, 0)};
+        return true;
+    }
+};
+
+// How a noise_texture turns noise into a blend between its two colours.
+enum class noise_pattern
+{
+    smooth,     // the noise itself: soft blotches
+    turbulence, // octaves of |noise|: clouds
+    marble,     // bands along z, warped by turbulence
+    wood        // rings around the y axis, warped by turbulence
+};
+
+class noise_texture : public texture
+{
+    shared_ptr<perlin> noise;
+    float scale;
+    noise_pattern pattern;
+    color low, high;
+
+    // Baked samples of field_at() on a resolution^3 grid spanning bake_bounds; empty if not baked.
+    aabb bake_bounds;
+    int resolution = 0;
+    std::vector<float> baked;
+
+    // Continuous field behind the pattern at p, which shape() turns into the blend factor. Only
+    // wood differs from the blend factor itself: its rings value grows without bound, and the
+    // sawtooth is taken afterwards so that interpolating baked samples does not smear it.
+    float field_at(const vec3 &p) const
+    {
+        switch (pattern)
+        {
+        case noise_pattern::smooth:
+            return 0.5f * (1 + noise->noise(scale * p));
+        case noise_pattern::turbulence:
+            return std::min(1.f, noise->turb(scale * p, octaves));
+        case noise_pattern::marble:
+            return 0.5f * (1 + std::sin(scale * p.z + 10 * noise->turb(p, octaves)));
+        case noise_pattern::wood:
+            return scale * std::sqrt(p.x * p.x + p.z * p.z) + 2 * noise->turb(p, octaves);
+        }
+        return 0;
+    }
+
+    // Blend factor in [0, 1] for a field_at() value.
+    float shape(float field) const
+    {
+        if (pattern == noise_pattern::wood)
+            return field - std::floor(field);
+        return field;
+    }
+
+    // Trilinear lookup in the baked grid; false outside it.
+    bool lookup(const vec3 &p, float &t) const
+    {
+        float f[3];
+        int cell[3];
+        for (int a = 0; a < 3; a++)
+        {
+            const interval &axis = bake_bounds.axis_interval(a);
+            float x = (p[a] - axis.min) / axis.size() * (resolution - 1);
+            if (!(x >= 0 && x <= resolution - 1))
+                return false;
+            cell[a] = std::min(int(x), resolution - 2);
+            f[a] = x - cell[a];
+        }
+        auto at = [&](int dx, int dy, int dz)
+        { return baked[(size_t(cell[2] + dz) * resolution + cell[1] + dy) * resolution + cell[0] + dx]; };
+        float x00 = at(0, 0, 0) + f[0] * (at(1, 0, 0) - at(0, 0, 0));
+        float x10 = at(0, 1, 0) + f[0] * (at(1, 1, 0) - at(0, 1, 0));
+        float x01 = at(0, 0, 1) + f[0] * (at(1, 0, 1) - at(0, 0, 1));
+        float x11 = at(0, 1, 1) + f[0] * (at(1, 1, 1) - at(0, 1, 1));
+        float y0 = x00 + f[1] * (x10 - x00);
+        float y1 = x01 + f[1] * (x11 - x01);
+        t = y0 + f[2] * (y1 - y0);
+        return true;
+    }
+
+public:
+    int octaves = 7; // turbulence octaves
+
+    noise_texture(float scale, noise_pattern pattern = noise_pattern::smooth, const color &low = color(0, 0, 0),
+                  const color &high = color(1, 1, 1), shared_ptr<perlin> noise = make_shared<perlin>())
+        : noise(noise), scale(scale), pattern(pattern), low(low), high(high) {}
+
+    color value(float u, float v, const vec3 &point) const override
+    {
+        float t;
+        if (baked.empty() || !lookup(point, t))
+            t = field_at(point);
+        t = shape(t);
+        return low + t * (high - low);
+    }
+
+    // Samples the pattern's field once on a resolution^3 grid over bounds (on the thread pool) and answers
+    // lookups inside bounds from it. Worth it for static noise under many samples per pixel, as
+    // long as the grid is fine enough for the pattern's smallest features; points outside bounds
+    // are evaluated as before.
+    void bake(const aabb &bounds, int grid_resolution)
+    {
+        resolution = std::max(2, grid_resolution);
+        bake_bounds = bounds;
+        std::vector<float> grid(size_t(resolution) * resolution * resolution);
+        float step[3];
+        for (int a = 0; a < 3; a++)
+            step[a] = bounds.axis_interval(a).size() / (resolution - 1);
+        thread_pool::global().parallel_for(resolution, [&](size_t z)
+                                           {
+            for (int y = 0; y < resolution; y++)
+                for (int x = 0; x < resolution; x++)
+                {
+                    vec3 p(bounds.x.min + x * step[0], bounds.y.min + y * step[1], bounds.z.min + z * step[2]);
+                    grid[(z * resolution + y) * resolution + x] = field_at(p);
+                } });
+        baked = std::move(grid);
+    }
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads shared by everything that renders or builds in parallel.
+class thread_pool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    void worker_loop()
+    {
+        tracer::name_thread("pool worker");
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this]
+                               { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit thread_pool(unsigned threads = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        for (unsigned i = 0; i < threads; i++)
+            workers.emplace_back([this]
+                                 { worker_loop(); });
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        available.notify_one();
+    }
+
+    // Runs body(i) for every i in [0, count) and returns once all of them have finished. The calling
+    // thread takes indices too, so this is safe to call from inside a pool task.
+    template <typename Body>
+    void parallel_for(size_t count, Body &&body)
+    {
+        struct shared_state
+        {
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto state = std::make_shared<shared_state>();
+        auto run = [state, count, &body]
+        {
+            for (size_t i; (i = state->next++) < count;)
+            {
+                body(i);
+                if (++state->done == count)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->finished.notify_all();
+                }
+            }
+        };
+
+        size_t helpers = std::min(count, size());
+        for (size_t h = 1; h < helpers; h++)
+            submit(run);
+        run();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&]
+                             { return state->done == count; });
+    }
+
+    static thread_pool &global()
+    {
+        static thread_pool pool;
+        return pool;
+    }
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of what every thread was doing, for finding load imbalance and stalls that aggregate
+// counters hide. Off until start() is called; after that each trace_span records one event into a
+// ring buffer owned by its thread, so recording takes no locks and the oldest events of a thread
+// are overwritten once its buffer is full. write() exports Chrome trace_event JSON, which
+// chrome://tracing and ui.perfetto.dev open directly.
+class tracer
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct event
+    {
+        const char *name; // string literals only: names are stored, not copied
+        const char *category;
+        int64_t index; // row, band, pass or chunk the span covered; -1 for none
+        clock::time_point begin, end;
+    };
+
+private:
+    // Written only by its own thread; write() reads it once that thread's work is done.
+    struct thread_buffer
+    {
+        std::unique_ptr<event[]> events;
+        size_t capacity;
+        std::atomic<uint64_t> recorded{0};
+        const char *thread_name;
+        uint32_t thread_id;
+    };
+
+    std::atomic<bool> on{false};
+    size_t capacity = 0;
+    clock::time_point epoch;
+    std::mutex mutex; // guards buffers
+    std::vector<std::unique_ptr<thread_buffer>> buffers;
+
+    static const char *&local_name()
+    {
+        thread_local const char *name = nullptr;
+        return name;
+    }
+
+    thread_buffer &local_buffer()
+    {
+        thread_local thread_buffer *buffer = nullptr;
+        if (!buffer)
+        {
+            auto created = std::make_unique<thread_buffer>();
+            created->events = std::make_unique<event[]>(capacity);
+            created->capacity = capacity;
+            created->thread_name = local_name();
+            std::lock_guard<std::mutex> lock(mutex);
+            created->thread_id = uint32_t(buffers.size());
+            buffer = created.get();
+            buffers.push_back(std::move(created));
+        }
+        return *buffer;
+    }
+
+public:
+    static tracer &global()
+    {
+        static tracer instance;
+        return instance;
+    }
+
+    // Starts recording, keeping up to events_per_thread of the latest events of each thread.
+    void start(size_t events_per_thread = 1 << 16)
+    {
+        if (on)
+            return;
+        capacity = std::max<size_t>(events_per_thread, 1);
+        epoch = clock::now();
+        on.store(true, std::memory_order_release);
+    }
+    // Acquire pairs with start()'s release, so a thread that sees tracing on also sees capacity
+    // and epoch.
+    bool enabled() const { return on.load(std::memory_order_acquire); }
+
+    // Label for the calling thread's track in the viewer; call before it records anything.
+    static void name_thread(const char *name) { local_name() = name; }
+
+    void record(const event &e)
+    {
+        thread_buffer &buffer = local_buffer();
+        uint64_t n = buffer.recorded.load(std::memory_order_relaxed);
+        buffer.events[n % buffer.capacity] = e;
+        buffer.recorded.store(n + 1, std::memory_order_release);
+    }
+
+    // Writes every recorded event as a complete ("X") event with microsecond timestamps, plus a
+    // name for each thread. Meant for after the traced work has finished.
+    bool write(const std::string &path)
+    {
+        std::ofstream out(path);
+        auto micros = [this](clock::time_point t)
+        { return std::chrono::duration<double, std::micro>(t - epoch).count(); };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        auto separate = [&]
+        {
+            out << (first ? "\n" : ",\n");
+            first = false;
+        };
+        for (const auto &buffer : buffers)
+        {
+            separate();
+            out << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->thread_id
+                << ",\"args\":{\"name\":\"";
+            if (buffer->thread_name)
+                out << buffer->thread_name << " #" << buffer->thread_id;
+            else
+                out << "thread " << buffer->thread_id;
+            out << "\"}}";
+
+            uint64_t recorded = buffer->recorded.load(std::memory_order_acquire);
+            uint64_t kept = std::min<uint64_t>(recorded, buffer->capacity);
+            for (uint64_t n = recorded - kept; n < recorded; n++)
+            {
+                const event &e = buffer->events[n % buffer->capacity];
+                separate();
+                out << "{\"ph\":\"X\",\"name\":\"" << e.name << "\",\"cat\":\"" << e.category
+                    << "\",\"pid\":1,\"tid\":" << buffer->thread_id << ",\"ts\":" << micros(e.begin)
+                    << ",\"dur\":" << micros(e.end) - micros(e.begin);
+                if (e.index >= 0)
+                    out << ",\"args\":{\"index\":" << e.index << '}';
+                out << '}';
+            }
+            if (recorded > kept)
+                std::clog << "Trace: thread " << buffer->thread_id << " dropped its " << recorded - kept
+                          << " oldest events" << std::endl;
+        }
+        out << "\n]}\n";
+        return bool(out);
+    }
+};
+
+// Records the span from its construction to its destruction on the calling thread, when tracing
+// is on. Costs one atomic load otherwise.
+class trace_span
+{
+    tracer::event e{};
+    bool active;
+
+public:
+    trace_span(const char *name, const char *category, int64_t index = -1)
+        : active(tracer::global().enabled())
+    {
+        if (active)
+            e = {name, category, index, tracer::clock::now(), {}};
+    }
+    ~trace_span()
+    {
+        if (!active)
+            return;
+        e.end = tracer::clock::now();
+        tracer::global().record(e);
+    }
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+};
@@ -5,49 +5,55 @@
 
 using std::sqrt;
 
-class vec3
+// vec3 is backed by one 4-lane register: SSE on x86, NEON on ARM, plain floats otherwise.
+// The fourth lane is padding. The component constructors zero it, but vec3(float4) keeps
+// whatever the register holds (aabb's corners leave it undefined), so reductions such as dot()
+// and max_component() read the x, y and z lanes only.
+#if defined(__SSE__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RT_SIMD_SSE 1
+using float4 = __m128;
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RT_SIMD_NEON 1
+using float4 = float32x4_t;
+#else
+struct float4
 {
-public:
-    float x, y, z;
-    vec3() : x(0.f), y(0.f), z(0.f) {}
-    vec3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+    float v[4];
+};
+#endif
 
-    vec3 operator-() const { return vec3(-x, -y, -z); }
-    float operator[](int i) const
-    {
-        if (i == 1)
-            return y;
-        if (i == 2)
-            return z;
-        return x;
-    }
-    float &operator[](int i)
-    {
-        if (i == 1)
-            return y;
-        if (i == 2)
-            return z;
-        return x;
-    }
-    vec3 &operator+=(const vec3 &v)
+class alignas(16) vec3
+{
+public:
+    union
     {
-        x += v.x;
-        y += v.y;
-        z += v.z;
-        return *this;
-    }
+        struct
+        {
+            float x, y, z, pad;
+        };
+        float e[4];
+        float4 m;
+    };
 
-    vec3 &operator*=(float t)
-    {
-        x *= t;
-        y *= t;
-        z *= t;
-        return *this;
-    }
+#if RT_SIMD_SSE
+    vec3() : m(_mm_setzero_ps()) {}
+    vec3(float _x, float _y, float _z) : m(_mm_set_ps(0.f, _z, _y, _x)) {}
+#else
+    vec3() : e{0.f, 0.f, 0.f, 0.f} {}
+    vec3(float _x, float _y, float _z) : e{_x, _y, _z, 0.f} {}
+#endif
+    explicit vec3(const float4 &v) : m(v) {}
 
+    vec3 operator-() const;
+    float operator[](int i) const { return e[i]; }
+    float &operator[](int i) { return e[i]; }
+    vec3 &operator+=(const vec3 &v);
+    vec3 &operator*=(float t);
     vec3 &operator/=(float t) { return *this *= 1 / t; }
     float length() const { return sqrt(length_squared()); }
-    float length_squared() const { return x * x + y * y + z * z; }
+    float length_squared() const;
 
     bool near_zero() const
     {
@@ -56,13 +62,94 @@ public:
     }
 };
 
-inline std::ostream &operator<<(std::ostream &out, const vec3 &v) { return out << v.x << ' ' << v.y << ' ' << v.z; }
+#if RT_SIMD_SSE
+inline vec3 operator+(const vec3 &a, const vec3 &b) { return vec3(_mm_add_ps(a.m, b.m)); }
+inline vec3 operator-(const vec3 &a, const vec3 &b) { return vec3(_mm_sub_ps(a.m, b.m)); }
+inline vec3 operator*(const vec3 &u, const vec3 &v) { return vec3(_mm_mul_ps(u.m, v.m)); }
+inline vec3 operator*(float t, const vec3 &v) { return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+inline vec3 vmin(const vec3 &a, const vec3 &b) { return vec3(_mm_min_ps(a.m, b.m)); }
+inline vec3 vmax(const vec3 &a, const vec3 &b) { return vec3(_mm_max_ps(a.m, b.m)); }
+inline vec3 rcp(const vec3 &v)
+{
+    auto r = _mm_div_ps(_mm_set1_ps(1.f), v.m);
+    return vec3(_mm_and_ps(r, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))));
+}
+inline float dot(const vec3 &u, const vec3 &v)
+{
+    auto p = _mm_mul_ps(u.m, v.m);
+    auto s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(p, p)));
+}
+inline vec3 cross(const vec3 &u, const vec3 &v)
+{
+    auto u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    auto v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    auto c = _mm_sub_ps(_mm_mul_ps(u.m, v_yzx), _mm_mul_ps(u_yzx, v.m));
+    return vec3(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+// Largest / smallest of the x, y and z lanes.
+inline float max_component(const vec3 &v)
+{
+    auto m = _mm_max_ss(v.m, _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_movehl_ps(v.m, v.m)));
+}
+inline float min_component(const vec3 &v)
+{
+    auto m = _mm_min_ss(v.m, _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_movehl_ps(v.m, v.m)));
+}
+// Approximate 1/x and 1/sqrt(x) refined by one Newton-Raphson step (~22 bits). Not safe for zero.
+inline vec3 rcp_fast(const vec3 &v)
+{
+    auto r = _mm_rcp_ps(v.m);
+    r = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.f), _mm_mul_ps(v.m, r)));
+    return vec3(_mm_and_ps(r, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1))));
+}
+inline float rsqrt_fast(float x)
+{
+    auto v = _mm_set_ss(x);
+    auto r = _mm_rsqrt_ss(v);
+    auto half_vrr = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), v), _mm_mul_ss(r, r));
+    return _mm_cvtss_f32(_mm_mul_ss(r, _mm_sub_ss(_mm_set_ss(1.5f), half_vrr)));
+}
+#elif RT_SIMD_NEON
+inline vec3 operator+(const vec3 &a, const vec3 &b) { return vec3(vaddq_f32(a.m, b.m)); }
+inline vec3 operator-(const vec3 &a, const vec3 &b) { return vec3(vsubq_f32(a.m, b.m)); }
+inline vec3 operator*(const vec3 &u, const vec3 &v) { return vec3(vmulq_f32(u.m, v.m)); }
+inline vec3 operator*(float t, const vec3 &v) { return vec3(vmulq_n_f32(v.m, t)); }
+inline vec3 vmin(const vec3 &a, const vec3 &b) { return vec3(vminq_f32(a.m, b.m)); }
+inline vec3 vmax(const vec3 &a, const vec3 &b) { return vec3(vmaxq_f32(a.m, b.m)); }
+inline vec3 rcp(const vec3 &v) { return vec3(1.f / v.x, 1.f / v.y, 1.f / v.z); }
+inline float dot(const vec3 &u, const vec3 &v) { return vaddvq_f32(vsetq_lane_f32(0.f, vmulq_f32(u.m, v.m), 3)); }
+inline vec3 cross(const vec3 &u, const vec3 &v)
+{
+    return vec3(u.y * v.z - u.z * v.y,
+                u.z * v.x - u.x * v.z,
+                u.x * v.y - u.y * v.x);
+}
+inline float max_component(const vec3 &v) { return fmaxf(fmaxf(v.x, v.y), v.z); }
+inline float min_component(const vec3 &v) { return fminf(fminf(v.x, v.y), v.z); }
+inline vec3 rcp_fast(const vec3 &v)
+{
+    auto r = vrecpeq_f32(v.m);
+    r = vmulq_f32(r, vrecpsq_f32(v.m, r));
+    return vec3(vsetq_lane_f32(0.f, r, 3));
+}
+inline float rsqrt_fast(float x)
+{
+    auto v = vdupq_n_f32(x);
+    auto r = vrsqrteq_f32(v);
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(v, r), r));
+    return vgetq_lane_f32(r, 0);
+}
+#else
 inline vec3 operator+(const vec3 &a, const vec3 &b) { return vec3(a.x + b.x, a.y + b.y, a.z + b.z); }
 inline vec3 operator-(const vec3 &a, const vec3 &b) { return vec3(a.x - b.x, a.y - b.y, a.z - b.z); }
 inline vec3 operator*(const vec3 &u, const vec3 &v) { return vec3(v.x * u.x, v.y * u.y, v.z * u.z); }
 inline vec3 operator*(float t, const vec3 &v) { return vec3(v.x * t, v.y * t, v.z * t); }
-inline vec3 operator*(const vec3 &v, float t) { return t * v; }
-inline vec3 operator/(const vec3 &v, float t) { return (1.0f / t) * v; }
+inline vec3 vmin(const vec3 &a, const vec3 &b) { return vec3(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z)); }
+inline vec3 vmax(const vec3 &a, const vec3 &b) { return vec3(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z)); }
+inline vec3 rcp(const vec3 &v) { return vec3(1.f / v.x, 1.f / v.y, 1.f / v.z); }
 inline float dot(const vec3 &u, const vec3 &v) { return u.x * v.x + u.y * v.y + u.z * v.z; }
 inline vec3 cross(const vec3 &u, const vec3 &v)
 {
@@ -70,7 +157,23 @@ inline vec3 cross(const vec3 &u, const vec3 &v)
                 u.z * v.x - u.x * v.z,
                 u.x * v.y - u.y * v.x);
 }
+inline float max_component(const vec3 &v) { return fmaxf(fmaxf(v.x, v.y), v.z); }
+inline float min_component(const vec3 &v) { return fminf(fminf(v.x, v.y), v.z); }
+inline vec3 rcp_fast(const vec3 &v) { return rcp(v); }
+inline float rsqrt_fast(float x) { return 1.f / sqrt(x); }
+#endif
+
+inline vec3 vec3::operator-() const { return vec3() - *this; }
+inline vec3 &vec3::operator+=(const vec3 &v) { return *this = *this + v; }
+inline vec3 &vec3::operator*=(float t) { return *this = t * *this; }
+inline float vec3::length_squared() const { return dot(*this, *this); }
+
+inline std::ostream &operator<<(std::ostream &out, const vec3 &v) { return out << v.x << ' ' << v.y << ' ' << v.z; }
+inline vec3 operator*(const vec3 &v, float t) { return t * v; }
+inline vec3 operator/(const vec3 &v, float t) { return (1.0f / t) * v; }
 inline vec3 unit(const vec3 &v) { return v / v.length(); }
+// Normalize with the approximate reciprocal square root; fine for sampled and shading directions.
+inline vec3 unit_fast(const vec3 &v) { return rsqrt_fast(v.length_squared()) * v; }
 
 inline vec3 random_vec3() { return vec3(random_float(), random_float(), random_float()); }
 
@@ -100,7 +203,16 @@ inline vec3 random_in_unit_disk()
     }
 }
 
-inline vec3 random_unit_vector() { return unit(random_in_unit_sphere()); }
+inline vec3 random_unit_vector() { return unit_fast(random_in_unit_sphere()); }
+
+// Cosine-weighted direction around +z.
+inline vec3 random_cosine_direction()
+{
+    float r1 = random_float();
+    float r2 = random_float();
+    float phi = 2 * PI * r1;
+    return vec3(cos(phi) * sqrt(r2), sin(phi) * sqrt(r2), sqrt(1 - r2));
+}
 
 inline vec3 random_on_hemisphere(const vec3 &normal)
 {
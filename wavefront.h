@@ -0,0 +1,239 @@
+#pragma once
+
+#include "rtw.h"
+#include "environment.h"
+#include "hittable.h"
+#include "material.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+// Breadth-first alternative to camera::ray_color. Instead of following one path to the end, a
+// large batch of path states advances one bounce at a time through separate stages:
+//
+//   generate  - top the batch up with fresh camera rays
+//   sort      - order rays by direction octant, then by the Morton cell of their origin, so
+//               neighbouring rays walk the same BVH nodes
+//   intersect - closest hit for every ray in the batch
+//   shade     - group hits by material type and instance, so each scatter kernel
+//               (lambertian, metal, dielectric, ...) runs over a contiguous run of hits
+//
+// Surviving paths are queued for the next bounce alongside newly generated ones, and the whole
+// batch is sorted again each round. Intersect and shade split the batch into blocks on the global
+// thread pool; shading results are merged in block order, so the image does not depend on which
+// thread ran which block.
+class wavefront_integrator
+{
+    struct path_state
+    {
+        ray r;
+        color throughput;
+        uint32_t pixel;
+        int depth;
+        bool waited = false; // deferred once already; traced next round whether ready or not
+    };
+
+    std::vector<path_state> paths, sorted, next;
+    std::vector<hitrecord> hits;
+    std::vector<uint8_t> hit_flags; // 0 missed, 1 hit, or deferred
+    static constexpr uint8_t deferred = 2;
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+
+    struct shade_key
+    {
+        size_t type;
+        const material *mat;
+        uint32_t index;
+
+        bool operator<(const shade_key &o) const
+        {
+            return type != o.type ? type < o.type : mat != o.mat ? mat < o.mat : index < o.index;
+        }
+    };
+    std::vector<shade_key> shade_keys;
+
+    // What shading one block of shade_keys produced, merged into the image and next afterwards.
+    struct shade_output
+    {
+        std::vector<path_state> next;
+        std::vector<std::pair<uint32_t, color>> radiance; // pixel, contribution
+    };
+    std::vector<shade_output> outputs;
+
+    static constexpr size_t block_size = 1024;
+    static size_t block_count(size_t n) { return (n + block_size - 1) / block_size; }
+
+    // Spread the low 21 bits of v so that two zero bits separate each original bit.
+    static uint64_t spread_bits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffff;
+        v = (v | v << 16) & 0x1f0000ff0000ff;
+        v = (v | v << 8) & 0x100f00f00f00f00f;
+        v = (v | v << 4) & 0x10c30c30c30c30c3;
+        v = (v | v << 2) & 0x1249249249249249;
+        return v;
+    }
+
+    static uint64_t coherence_key(const ray &r, const aabb &bounds)
+    {
+        const auto &d = r.direction();
+        uint64_t octant = (d.x < 0) | (d.y < 0) << 1 | (d.z < 0) << 2;
+
+        uint64_t cell = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const interval &ax = bounds.axis_interval(axis);
+            float extent = ax.size() > 0 ? ax.size() : 1;
+            float f = interval(0, 1).clamp((r.origin()[axis] - ax.min) / extent);
+            cell |= spread_bits(uint64_t(f * 1023)) << axis;
+        }
+        return octant << 30 | cell;
+    }
+
+    void sort_paths(const aabb &bounds)
+    {
+        keys.resize(paths.size());
+        for (uint32_t i = 0; i < paths.size(); i++)
+            keys[i] = {coherence_key(paths[i].r, bounds), i};
+        std::sort(keys.begin(), keys.end());
+
+        sorted.resize(paths.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            sorted[i] = paths[keys[i].second];
+        std::swap(paths, sorted);
+    }
+
+    // Rays whose geometry is still being read in are put off to the next round instead of waited
+    // for, but only once: the loader gets a round's head start, and a budget too small for the
+    // batch's working set cannot starve a ray by evicting its geometry again before it is traced.
+    void intersect(const hittable &world)
+    {
+        hits.resize(paths.size());
+        hit_flags.resize(paths.size());
+        std::atomic<size_t> traced{0};
+        thread_pool::global().parallel_for(block_count(paths.size()), [&](size_t b)
+                                           {
+            trace_span span("intersect", "render", int64_t(b));
+            size_t end = std::min(paths.size(), (b + 1) * block_size), count = 0;
+            for (size_t i = b * block_size; i < end; i++)
+            {
+                if (!paths[i].waited && !world.ready(paths[i].r, interval(0.001, infinity)))
+                {
+                    hit_flags[i] = deferred;
+                    continue;
+                }
+                hit_flags[i] = world.hit(paths[i].r, interval(0.001, infinity), hits[i]);
+                count++;
+            }
+            traced += count; });
+        rays_traced += traced;
+    }
+
+    void shade(std::vector<color> &image)
+    {
+        shade_keys.clear();
+        for (uint32_t i = 0; i < paths.size(); i++)
+        {
+            if (hit_flags[i] == deferred)
+            {
+                next.push_back(paths[i]);
+                next.back().waited = true;
+                continue;
+            }
+            if (!hit_flags[i])
+            {
+                image[paths[i].pixel] += paths[i].throughput *
+                                         (environment ? environment->value(paths[i].r.direction()) : background);
+                continue;
+            }
+            // Material type first so one scatter implementation runs at a time, then instance.
+            auto mat = hits[i].mat;
+            shade_keys.push_back({typeid(*mat).hash_code(), mat, i});
+        }
+        std::sort(shade_keys.begin(), shade_keys.end());
+
+        size_t blocks = block_count(shade_keys.size());
+        if (outputs.size() < blocks)
+            outputs.resize(blocks);
+        thread_pool::global().parallel_for(blocks, [&](size_t b)
+                                           {
+            trace_span span("shade", "render", int64_t(b));
+            shade_output &out = outputs[b];
+            out.next.clear();
+            out.radiance.clear();
+            size_t end = std::min(shade_keys.size(), (b + 1) * block_size);
+            for (size_t k = b * block_size; k < end; k++)
+            {
+                const auto &path = paths[shade_keys[k].index];
+                const auto &rec = hits[shade_keys[k].index];
+
+                out.radiance.push_back({path.pixel, path.throughput * rec.mat->emitted(rec.u, rec.v, rec.position)});
+
+                ray scattered;
+                color attenuation;
+                if (path.depth > 1 && rec.mat->scatter(path.r, rec, attenuation, scattered))
+                    out.next.push_back({scattered, path.throughput * attenuation, path.pixel, path.depth - 1, false});
+            } });
+
+        for (size_t b = 0; b < blocks; b++)
+        {
+            for (const auto &[pixel, radiance] : outputs[b].radiance)
+                image[pixel] += radiance;
+            next.insert(next.end(), outputs[b].next.begin(), outputs[b].next.end());
+        }
+    }
+
+public:
+    size_t batch_size = 1 << 16;
+    int max_depth = 10;
+    color background;
+    const environment_light *environment = nullptr;
+    uint64_t rays_traced = 0;
+
+    // Accumulates the sum of every sample into image (width * height, row-major); the caller
+    // divides by the sample count. get_ray(i, j) produces one camera sample for pixel (i, j).
+    template <typename RayGenerator>
+    void render(const hittable &world, int width, int height, int samples_per_pixel,
+                RayGenerator &&get_ray, std::vector<color> &image)
+    {
+        image.assign(size_t(width) * height, color(0, 0, 0));
+        if (max_depth <= 0)
+            return;
+        auto bounds = world.bounding_box();
+
+        size_t total = size_t(width) * height * samples_per_pixel;
+        size_t generated = 0;
+        size_t last_row = 0;
+
+        while (generated < total || !paths.empty())
+        {
+            while (paths.size() < batch_size && generated < total)
+            {
+                uint32_t pixel = uint32_t(generated / samples_per_pixel);
+                paths.push_back({get_ray(pixel % width, pixel / width), color(1, 1, 1), pixel, max_depth, false});
+                generated++;
+            }
+
+            sort_paths(bounds);
+            intersect(world);
+            shade(image);
+
+            std::swap(paths, next);
+            next.clear();
+
+            size_t row = generated / samples_per_pixel / width;
+            if (row != last_row)
+            {
+                std::clog << "Scanlines remaining: " << height - row << std::endl;
+                last_row = row;
+            }
+        }
+    }
+};